@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include "lib/dmt/dmt.h"
+#include "atlas.h"
+
+/* Images are packed into pages using shelves: rows of images which are filled
+ * left to right, a new shelf being started below the last once an image no
+ * longer fits. Space is not reused when an image is freed, the page itself is
+ * freed once none of its images remain */
+
+atlas_page_t *atlas_pages;
+int atlas_enabled;
+
+
+void atlas_setEnabled(int enable) {
+  atlas_enabled = !!enable;
+}
+
+
+int atlas_isEnabled(void) {
+  return atlas_enabled;
+}
+
+
+static int place(atlas_page_t *page, int w, int h, int *x, int *y) {
+  /* Start a new shelf if the image doesn't fit on the end of the last one */
+  int sx = page->shelfX, sy = page->shelfY, sh = page->shelfHeight;
+  if (sx + w > ATLAS_PAGE_SIZE) {
+    sx = 0;
+    sy += sh;
+    sh = 0;
+  }
+  if (sy + h > ATLAS_PAGE_SIZE) {
+    return 0;
+  }
+  *x = sx;
+  *y = sy;
+  page->shelfX = sx + w;
+  page->shelfY = sy;
+  page->shelfHeight = (h > sh) ? h : sh;
+  return 1;
+}
+
+
+atlas_page_t *atlas_alloc(int w, int h, pixel_t **data, pixel_t **mask) {
+  /* Finds space for a `w` x `h` image and sets `data` and `mask` to its top
+   * left pixel; the rows of both are ATLAS_PAGE_SIZE pixels apart. `mask` can
+   * be NULL if the image has no mask. Returns NULL if the image is too large
+   * for a page */
+  atlas_page_t *page;
+  int x = 0, y = 0;
+  if (w <= 0 || h <= 0 || w > ATLAS_PAGE_SIZE || h > ATLAS_PAGE_SIZE) {
+    return NULL;
+  }
+  for (page = atlas_pages; page; page = page->next) {
+    if (place(page, w, h, &x, &y)) goto found;
+  }
+  /* No page had space -- add a new one */
+  page = dmt_calloc(1, sizeof(*page));
+  page->data = dmt_calloc(1, ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE);
+  page->next = atlas_pages;
+  atlas_pages = page;
+  /* An empty page always has space for the image at 0, 0 */
+  place(page, w, h, &x, &y);
+found:
+  page->refs++;
+  *data = page->data + x + y * ATLAS_PAGE_SIZE;
+  if (mask) {
+    /* The page's mask is only allocated once an image needs it */
+    if (!page->mask) {
+      page->mask = dmt_malloc(ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE);
+      memset(page->mask, 0xff, ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE);
+    }
+    *mask = page->mask + x + y * ATLAS_PAGE_SIZE;
+  }
+  return page;
+}
+
+
+void atlas_release(atlas_page_t *page) {
+  atlas_page_t **p;
+  if (--page->refs > 0) return;
+  for (p = &atlas_pages; *p; p = &(*p)->next) {
+    if (*p == page) {
+      *p = page->next;
+      break;
+    }
+  }
+  dmt_free(page->data);
+  dmt_free(page->mask);
+  dmt_free(page);
+}
@@ -0,0 +1,28 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include "vga.h"
+
+#define ATLAS_PAGE_SIZE 256
+
+typedef struct atlas_page_t {
+  pixel_t *data;
+  pixel_t *mask;
+  int shelfX, shelfY, shelfHeight;
+  int refs;
+  struct atlas_page_t *next;
+} atlas_page_t;
+
+void atlas_setEnabled(int enable);
+int atlas_isEnabled(void);
+atlas_page_t *atlas_alloc(int w, int h, pixel_t **data, pixel_t **mask);
+void atlas_release(atlas_page_t *page);
+
+#endif
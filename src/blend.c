@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include "lib/dmt/dmt.h"
+#include "palette.h"
+#include "blend.h"
+
+/* Blend tables are indexed by `src << 8 | dst` and remap tables by `src`;
+ * each is rebuilt when it is next requested after the palette has changed */
+
+extern unsigned palette_palette[];
+extern int palette_nextIdx;
+
+struct { pixel_t *data; int version; } blend_tables[BLEND_TABLE_COUNT];
+struct {
+  pixel_t data[256];
+  int version;
+  pixel_t color;
+} blend_remaps[BLEND_REMAP_COUNT];
+int blend_inited;
+
+
+static void init(void) {
+  int i;
+  if (blend_inited) return;
+  for (i = 0; i < BLEND_TABLE_COUNT; i++) blend_tables[i].version = -1;
+  for (i = 0; i < BLEND_REMAP_COUNT; i++) blend_remaps[i].version = -1;
+  blend_inited = 1;
+}
+
+
+static void getColor(int idx, int *rgb) {
+  unsigned color = palette_palette[idx];
+  rgb[0] = (color      ) & 0xff;
+  rgb[1] = (color >>  8) & 0xff;
+  rgb[2] = (color >> 16) & 0xff;
+}
+
+
+static int blendColors(int kind, int a, int b) {
+  int ca[3], cb[3], c[3];
+  int i;
+  getColor(a, ca);
+  getColor(b, cb);
+  for (i = 0; i < 3; i++) {
+    if (kind == BLEND_ADD) {
+      c[i] = ca[i] + cb[i];
+      if (c[i] > 0xff) c[i] = 0xff;
+    } else {
+      c[i] = (ca[i] + cb[i]) >> 1;
+    }
+  }
+  return palette_nearestIdx(c[0], c[1], c[2]);
+}
+
+
+const pixel_t *blend_getTable(int kind) {
+  init();
+  if (blend_tables[kind].version == palette_version) {
+    return blend_tables[kind].data;
+  }
+  if (!blend_tables[kind].data) {
+    blend_tables[kind].data = dmt_calloc(1, 256 * 256);
+  }
+  /* Both blends are symmetric so only half of the pairs need blending. Only
+   * the indices in use are filled as no pixel can hold any other */
+  pixel_t *t = blend_tables[kind].data;
+  int n = palette_nextIdx;
+  int a, b;
+  for (a = 0; a < n; a++) {
+    for (b = 0; b <= a; b++) {
+      t[(a << 8) | b] = t[(b << 8) | a] = blendColors(kind, a, b);
+    }
+  }
+  blend_tables[kind].version = palette_version;
+  return t;
+}
+
+
+const pixel_t *blend_getRemap(int kind, pixel_t color) {
+  init();
+  if (blend_remaps[kind].version == palette_version &&
+      blend_remaps[kind].color == color
+  ) {
+    return blend_remaps[kind].data;
+  }
+  /* Darken multiplies each color by `color`, tint mixes each color halfway
+   * towards `color` */
+  pixel_t *t = blend_remaps[kind].data;
+  int cc[3], c[3];
+  int n = palette_nextIdx;
+  int idx, i;
+  getColor(color, cc);
+  for (idx = 0; idx < n; idx++) {
+    getColor(idx, c);
+    for (i = 0; i < 3; i++) {
+      if (kind == BLEND_DARKEN) {
+        c[i] = c[i] * cc[i] / 0xff;
+      } else {
+        c[i] = (c[i] + cc[i]) >> 1;
+      }
+    }
+    t[idx] = palette_nearestIdx(c[0], c[1], c[2]);
+  }
+  blend_remaps[kind].version = palette_version;
+  blend_remaps[kind].color = color;
+  return t;
+}
@@ -0,0 +1,28 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef BLEND_H
+#define BLEND_H
+
+#include "vga.h"
+
+enum {
+  BLEND_TRANSLUCENT,
+  BLEND_ADD,
+  BLEND_TABLE_COUNT,
+};
+
+enum {
+  BLEND_DARKEN,
+  BLEND_TINT,
+  BLEND_REMAP_COUNT,
+};
+
+const pixel_t *blend_getTable(int kind);
+const pixel_t *blend_getRemap(int kind, pixel_t color);
+
+#endif
@@ -0,0 +1,141 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include "dirty.h"
+#include "vga.h"
+
+#define MAX_RECTS 32
+
+typedef struct { int x0, y0, x1, y1; } rect_t;
+typedef struct { rect_t rects[MAX_RECTS]; int count; } rectlist_t;
+
+int dirty_enabled;
+int dirty_full;
+int dirty_clearColor;
+rectlist_t dirty_current;
+rectlist_t dirty_last;
+
+
+static int area(rect_t r) {
+  return (r.x1 - r.x0) * (r.y1 - r.y0);
+}
+
+
+static rect_t merge(rect_t a, rect_t b) {
+  rect_t r;
+  r.x0 = a.x0 < b.x0 ? a.x0 : b.x0;
+  r.y0 = a.y0 < b.y0 ? a.y0 : b.y0;
+  r.x1 = a.x1 > b.x1 ? a.x1 : b.x1;
+  r.y1 = a.y1 > b.y1 ? a.y1 : b.y1;
+  return r;
+}
+
+
+static void push(rectlist_t *list, rect_t r) {
+  /* Adds the rect to the list, merging it with any rect whose bounding box
+   * with it wastes no more area than the two rects would take separately. If
+   * the list is full the rect is merged with whichever rect grows least */
+  int i;
+restart:
+  for (i = 0; i < list->count; i++) {
+    rect_t m = merge(list->rects[i], r);
+    if (area(m) <= area(list->rects[i]) + area(r)) {
+      /* Remove the merged rect and re-add the bounding box, as it may now
+       * overlap others */
+      list->rects[i] = list->rects[--list->count];
+      r = m;
+      goto restart;
+    }
+  }
+  if (list->count == MAX_RECTS) {
+    int best = 0, bestGrowth = -1;
+    for (i = 0; i < list->count; i++) {
+      int growth = area(merge(list->rects[i], r)) - area(list->rects[i]);
+      if (bestGrowth < 0 || growth < bestGrowth) {
+        best = i;
+        bestGrowth = growth;
+      }
+    }
+    r = merge(list->rects[best], r);
+    list->rects[best] = list->rects[--list->count];
+    goto restart;
+  }
+  list->rects[list->count++] = r;
+}
+
+
+void dirty_setEnabled(int enable) {
+  dirty_enabled = !!enable;
+  /* The first clear and present after enabling must cover the whole screen */
+  dirty_full = 1;
+  dirty_current.count = 0;
+  dirty_last.count = 0;
+}
+
+
+int dirty_isEnabled(void) {
+  return dirty_enabled;
+}
+
+
+void dirty_add(int x, int y, int w, int h) {
+  /* Clip to screen */
+  rect_t r = { x, y, x + w, y + h };
+  if (r.x0 < 0) r.x0 = 0;
+  if (r.y0 < 0) r.y0 = 0;
+  if (r.x1 > VGA_WIDTH) r.x1 = VGA_WIDTH;
+  if (r.y1 > VGA_HEIGHT) r.y1 = VGA_HEIGHT;
+  if (r.x0 >= r.x1 || r.y0 >= r.y1) return;
+  push(&dirty_current, r);
+}
+
+
+void dirty_clear(pixel_t *buf, pixel_t color) {
+  /* Clears the areas drawn to since the last clear; the whole screen is
+   * cleared if the color has changed */
+  int i, y;
+  if (dirty_full || color != dirty_clearColor) {
+    memset(buf, color, VGA_WIDTH * VGA_HEIGHT);
+    dirty_clearColor = color;
+    dirty_full = 1;
+    return;
+  }
+  rectlist_t *lists[] = { &dirty_last, &dirty_current, NULL };
+  for (i = 0; lists[i]; i++) {
+    int j;
+    for (j = 0; j < lists[i]->count; j++) {
+      rect_t *r = &lists[i]->rects[j];
+      for (y = r->y0; y < r->y1; y++) {
+        memset(buf + r->x0 + y * VGA_WIDTH, color, r->x1 - r->x0);
+      }
+    }
+  }
+}
+
+
+void dirty_present(pixel_t *buf) {
+  /* Copies the areas drawn or cleared during this frame and the last one to
+   * video memory, then starts a new frame */
+  int i;
+  if (dirty_full) {
+    vga_update(buf);
+    dirty_full = 0;
+  } else {
+    rectlist_t list = dirty_current;
+    for (i = 0; i < dirty_last.count; i++) {
+      push(&list, dirty_last.rects[i]);
+    }
+    for (i = 0; i < list.count; i++) {
+      rect_t *r = &list.rects[i];
+      vga_updateRect(buf, r->x0, r->y0, r->x1 - r->x0, r->y1 - r->y0);
+    }
+  }
+  dirty_last = dirty_current;
+  dirty_current.count = 0;
+}
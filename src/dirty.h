@@ -0,0 +1,19 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include "vga.h"
+
+void dirty_setEnabled(int enable);
+int dirty_isEnabled(void);
+void dirty_add(int x, int y, int w, int h);
+void dirty_clear(pixel_t *buf, pixel_t color);
+void dirty_present(pixel_t *buf);
+
+#endif
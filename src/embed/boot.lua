@@ -100,10 +100,12 @@ function love.run()
     love.timer.step()
     local dt = love.timer.getDelta()
     if love.update then love.update(dt) end
-    -- Draw
-    love.graphics.clear()
-    if love.draw then love.draw() end
-    love.graphics.present()
+    -- Draw, unless the frame is skipped to catch up with the target FPS
+    if love.timer.shouldDraw() then
+      love.graphics.clear()
+      if love.draw then love.draw() end
+      love.graphics.present()
+    end
   end
 end
 
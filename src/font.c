@@ -14,51 +14,189 @@
 #include "filesystem.h"
 #include "font.h"
 
+/* Baked font files hold a font's glyphs rasterized ahead of time so it can be
+ * loaded without stb_truetype. The file contains a header, the glyphs, the
+ * kerning pairs sorted by codepoints and each page as a bit per pixel */
 
-static const char *initFont(font_t *self, const void *data, int ptsize) {
+#define MAGIC   0x4e46444c  /* "LDFN" */
+#define VERSION 1
+
+typedef struct {
+  unsigned magic, version;
+  unsigned height, pageSize, pageCount;
+  unsigned glyphCount, kernCount;
+} header_t;
+
+
+static unsigned hashCodepoint(unsigned codepoint) {
+  return codepoint * 2654435761u;
+}
+
+
+static font_glyph_t *findSlot(font_t *self, unsigned codepoint) {
+  /* Returns the hashmap slot holding the codepoint's glyph, or the empty slot
+   * it would be added to */
+  unsigned mask = self->glyphCapacity - 1;
+  unsigned i = (hashCodepoint(codepoint) >> 8) & mask;
+  while (self->glyphs[i].codepoint != -1 &&
+         self->glyphs[i].codepoint != (int) codepoint
+  ) {
+    i = (i + 1) & mask;
+  }
+  return &self->glyphs[i];
+}
+
+
+static void initGlyphs(font_t *self) {
   int i;
+  self->glyphCapacity = 256;
+  self->glyphs = dmt_malloc(self->glyphCapacity * sizeof(*self->glyphs));
+  for (i = 0; i < self->glyphCapacity; i++) {
+    self->glyphs[i].codepoint = -1;
+  }
+}
+
+
+static font_glyph_t *addGlyph(font_t *self, unsigned codepoint) {
+  /* Adds the codepoint to the hashmap, growing it if it's half full, and
+   * returns its uninitialised glyph */
+  if (self->glyphCount * 2 >= self->glyphCapacity) {
+    font_glyph_t *old = self->glyphs;
+    int i, n = self->glyphCapacity;
+    self->glyphCapacity <<= 1;
+    self->glyphs = dmt_malloc(self->glyphCapacity * sizeof(*self->glyphs));
+    for (i = 0; i < self->glyphCapacity; i++) {
+      self->glyphs[i].codepoint = -1;
+    }
+    for (i = 0; i < n; i++) {
+      if (old[i].codepoint != -1) {
+        *findSlot(self, old[i].codepoint) = old[i];
+      }
+    }
+    dmt_free(old);
+  }
+  font_glyph_t *g = findSlot(self, codepoint);
+  g->codepoint = codepoint;
+  self->glyphCount++;
+  return g;
+}
+
+
+static void addPage(font_t *self) {
+  self->pages = dmt_realloc(self->pages,
+                            (self->pageCount + 1) * sizeof(*self->pages));
+  image_t *img = &self->pages[self->pageCount++];
+  image_initBlank(img, self->pageSize, self->pageSize);
+  memset(img->mask, 0xff, self->pageSize * self->pageSize);
+  self->shelfX = 1;
+  self->shelfY = 1;
+  self->shelfBottom = 1;
+}
+
 
+static const char *initFont(font_t *self, const void *data, int ptsize) {
   /* Init font */
-  stbtt_fontinfo font;
-  if ( !stbtt_InitFont(&font, data, 0) ) {
+  if ( !stbtt_InitFont(&self->info, data, 0) ) {
     return "could not load font";
   }
 
   /* Get height and scale */
   int ascent, descent, lineGap;
-  stbtt_GetFontVMetrics(&font, &ascent, &descent, &lineGap);
-  float scale = stbtt_ScaleForMappingEmToPixels(&font, ptsize);
+  stbtt_GetFontVMetrics(&self->info, &ascent, &descent, &lineGap);
+  float scale = stbtt_ScaleForMappingEmToPixels(&self->info, ptsize);
   self->height = (ascent - descent + lineGap) * scale + 0.5;
+  self->ascent = ascent * scale + 0.5;
 
-  /* Init image */
-  int w = 128, h = 128;
-retry:
-  image_initBlank(&self->image, w, h);
+  /* Get the scale glyphs are rasterized at */
+  float s = stbtt_ScaleForMappingEmToPixels(&self->info, 1) /
+            stbtt_ScaleForPixelHeight(&self->info, 1);
+  self->scale = stbtt_ScaleForPixelHeight(&self->info, ptsize * s);
 
-  /* Load glyphs */
-  float s = stbtt_ScaleForMappingEmToPixels(&font, 1) /
-            stbtt_ScaleForPixelHeight(&font, 1);
-  int res = stbtt_BakeFontBitmap(
-    data, 0, ptsize * s, self->image.data, w, h, 0, 128, self->glyphs);
+  /* Size pages to hold at least 8 rows of glyphs */
+  self->pageSize = 128;
+  while (self->pageSize < self->height * 8) {
+    self->pageSize <<= 1;
+  }
 
-  /* Retry with a larger image buffer if the buffer wasn't large enough */
-  if (res < 0) {
-    w <<= 1;
-    h <<= 1;
-    image_deinit(&self->image);
-    goto retry;
+  /* Init glyph hashmap */
+  initGlyphs(self);
+
+  /* Init kerning cache if the font has kerning */
+  int i;
+  if (self->info.kern) {
+    self->kerning = dmt_malloc(FONT_KERN_CACHE * sizeof(*self->kerning));
+    for (i = 0; i < FONT_KERN_CACHE; i++) {
+      self->kerning[i].a = self->kerning[i].b = ~0u;
+    }
   }
 
-  /* Adjust glyph yoffsets */
-  int scaledAscent = ascent * scale + 0.5;
-  for (i = 0; i < 128; i++) {
-    self->glyphs[i].yoff += scaledAscent;
+  /* Return NULL for no error */
+  return NULL;
+}
+
+
+static const char *initBaked(font_t *self, const char *data, int size) {
+  /* Check the header */
+  header_t h;
+  if (size < (int) sizeof(h)) return "could not load font";
+  memcpy(&h, data, sizeof(h));
+  unsigned pagebytes = h.pageSize * h.pageSize / 8;
+  if (h.version != VERSION || h.pageSize < 8 || h.pageSize > 4096 ||
+      h.pageSize % 8 != 0 || h.pageCount == 0 || h.pageCount > 256 ||
+      h.glyphCount > 0x10000 || h.kernCount > 0x100000 ||
+      (unsigned) size != sizeof(h) + h.glyphCount * sizeof(font_glyph_t) +
+        h.kernCount * sizeof(font_kern_t) + h.pageCount * pagebytes
+  ) {
+    return "could not load baked font";
   }
+  data += sizeof(h);
 
-  /* Init image data and mask */
-  for (i = 0; i < w * h; i++) {
-    self->image.data[i] = (self->image.data[i] > 127) ? 1 : 0;
-    self->image.mask[i] = (self->image.data[i] == 0) ? 0xff : 0;
+  /* Check each glyph is within its page */
+  unsigned i;
+  for (i = 0; i < h.glyphCount; i++) {
+    font_glyph_t g;
+    memcpy(&g, data + i * sizeof(g), sizeof(g));
+    if (g.codepoint < 0 || g.codepoint > 0x10ffff ||
+        g.page < 0 || g.page >= (int) h.pageCount ||
+        g.c.x0 > g.c.x1 || g.c.x1 > h.pageSize ||
+        g.c.y0 > g.c.y1 || g.c.y1 > h.pageSize
+    ) {
+      return "could not load baked font";
+    }
+  }
+  self->height = h.height;
+  self->pageSize = h.pageSize;
+
+  /* Load glyphs */
+  initGlyphs(self);
+  for (i = 0; i < h.glyphCount; i++) {
+    font_glyph_t g;
+    memcpy(&g, data, sizeof(g));
+    data += sizeof(g);
+    *addGlyph(self, g.codepoint) = g;
+  }
+
+  /* Load kerning pairs */
+  if (h.kernCount > 0) {
+    self->kernCount = h.kernCount;
+    self->kernPairs = dmt_malloc(h.kernCount * sizeof(font_kern_t));
+    memcpy(self->kernPairs, data, h.kernCount * sizeof(font_kern_t));
+    data += h.kernCount * sizeof(font_kern_t);
+  }
+
+  /* Load pages */
+  for (i = 0; i < h.pageCount; i++) {
+    addPage(self);
+    image_t *img = &self->pages[i];
+    const unsigned char *bits = (const unsigned char*) data;
+    unsigned j, n = h.pageSize * h.pageSize;
+    for (j = 0; j < n; j++) {
+      int set = (bits[j >> 3] >> (j & 7)) & 1;
+      img->data[j] = set;
+      img->mask[j] = set ? 0 : 0xff;
+    }
+    image_discardSpans(img);
+    data += pagebytes;
   }
 
   /* Return NULL for no error */
@@ -69,7 +207,6 @@ retry:
 const char *font_init(font_t *self, const char *filename, int ptsize) {
   const char *errmsg = NULL;
   void *data = NULL;
-  FILE *fp = NULL;
   memset(self, 0, sizeof(*self));
 
   /* Load font file */
@@ -80,20 +217,26 @@ const char *font_init(font_t *self, const char *filename, int ptsize) {
     goto fail;
   }
 
-  /* Init font */
+  /* Load baked font files directly; their size is fixed when baked */
+  unsigned magic = 0;
+  if (size >= (int) sizeof(magic)) memcpy(&magic, data, sizeof(magic));
+  if (magic == MAGIC) {
+    errmsg = initBaked(self, data, size);
+    filesystem_free(data);
+    return errmsg;
+  }
+
+  /* Init font; the font data is kept as glyphs are rasterized from it as they
+   * are needed */
   errmsg = initFont(self, data, ptsize);
   if (errmsg) {
     goto fail;
   }
-
-  /* Free font data */
-  filesystem_free(data);
-  data = NULL;
+  self->data = data;
 
   return NULL;
 
 fail:
-  if (fp) fclose(fp);
   filesystem_free(data);
   return errmsg;
 }
@@ -101,45 +244,581 @@ fail:
 
 const char *font_initEmbedded(font_t *self, int ptsize) {
   #include "font_ttf.h"
+  memset(self, 0, sizeof(*self));
   return initFont(self, font_ttf, ptsize);
 }
 
 
+const char *font_initImage(font_t *self, const char *filename,
+                           const char *glyphs, int spacing
+) {
+  /* Inits the font from an image of the glyphs in a row, each separated by
+   * columns whose top pixel is the color of the image's top left pixel. Any
+   * other pixels of that color are made transparent */
+  image_t img;
+  memset(self, 0, sizeof(*self));
+  const char *errmsg = image_init(&img, filename);
+  if (errmsg) return errmsg;
+  int x, y, stride = img.stride;
+  int sepColor = img.data[0];
+  int sepMask = img.mask ? img.mask[0] : 0;
+  #define IS_SEP(i)\
+    (img.data[i] == sepColor && (!img.mask || img.mask[i] == sepMask))
+
+  /* Make separator pixels transparent; the top row is checked first as it is
+   * used to find the glyphs */
+  pixel_t *top = dmt_malloc(img.width);
+  for (x = 0; x < img.width; x++) {
+    top[x] = IS_SEP(x);
+  }
+  for (y = 0; y < img.height; y++) {
+    for (x = 0; x < img.width; x++) {
+      int i = x + y * stride;
+      if (IS_SEP(i)) {
+        img.data[i] = 0;
+        if (img.mask) img.mask[i] = 0xff;
+      }
+    }
+  }
+  #undef IS_SEP
+  image_discardSpans(&img);
+
+  /* Init the font with the image as its only page */
+  self->colored = 1;
+  self->height = img.height;
+  self->pageSize = img.width > img.height ? img.width : img.height;
+  self->pageCount = 1;
+  self->pages = dmt_malloc(sizeof(*self->pages));
+  self->pages[0] = img;
+  initGlyphs(self);
+
+  /* Add a glyph for each span of non-separator columns */
+  x = 0;
+  while (*glyphs) {
+    unsigned cp = font_utf8Next(&glyphs);
+    while (x < img.width && top[x]) x++;
+    if (x >= img.width) break;
+    int x0 = x;
+    while (x < img.width && !top[x]) x++;
+    font_glyph_t *g = findSlot(self, cp);
+    if (g->codepoint == -1) g = addGlyph(self, cp);
+    memset(&g->c, 0, sizeof(g->c));
+    g->page = 0;
+    g->c.x0 = x0;
+    g->c.x1 = x;
+    g->c.y1 = img.height;
+    g->c.xadvance = x - x0 + spacing;
+  }
+  dmt_free(top);
+
+  /* Return NULL for no error */
+  return NULL;
+}
+
+
+static int compareGlyphs(const void *a, const void *b) {
+  const font_glyph_t *x = a, *y = b;
+  return (unsigned) x->codepoint < (unsigned) y->codepoint ? -1 :
+         (unsigned) x->codepoint > (unsigned) y->codepoint;
+}
+
+
+const char *font_bake(const char *filename, int ptsize, const char *chars,
+                      const char *outfile
+) {
+  /* Rasterizes the printable ASCII characters, U+FFFD and the UTF-8 string
+   * `chars`, if it isn't NULL, and writes them to a baked font file along
+   * with the kerning between them. Files are accessed directly rather than
+   * through the filesystem module so this can be used before it is inited */
+  font_t font;
+  const char *errmsg = NULL;
+  FILE *fp = NULL;
+  unsigned char *bits = NULL;
+  void *data = NULL;
+  memset(&font, 0, sizeof(font));
+
+  /* Load font file */
+  fp = fopen(filename, "rb");
+  if (!fp) {
+    return "could not open font file";
+  }
+  fseek(fp, 0, SEEK_END);
+  int size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  data = dmt_malloc(size > 0 ? size : 1);
+  if (size <= 0 || fread(data, 1, size, fp) != (unsigned) size) {
+    errmsg = "could not read font file";
+    dmt_free(data);
+    goto end;
+  }
+  fclose(fp);
+  fp = NULL;
+  errmsg = initFont(&font, data, ptsize);
+  if (errmsg) {
+    dmt_free(data);
+    goto end;
+  }
+  font.data = data;
+
+  /* Rasterize glyphs */
+  unsigned c;
+  for (c = 32; c < 127; c++) {
+    font_getGlyph(&font, c);
+  }
+  font_getGlyph(&font, 0xfffd);
+  while (chars && *chars) {
+    font_getGlyph(&font, font_utf8Next(&chars));
+  }
+  if (font.pageCount == 0) addPage(&font);
+
+  /* Get the glyphs in codepoint order and the nonzero kerning between them */
+  font_glyph_t *glyphs = dmt_malloc(font.glyphCount * sizeof(*glyphs));
+  font_kern_t *kerning = NULL;
+  int i, j, n = 0, nkern = 0;
+  for (i = 0; i < font.glyphCapacity; i++) {
+    if (font.glyphs[i].codepoint != -1) glyphs[n++] = font.glyphs[i];
+  }
+  qsort(glyphs, n, sizeof(*glyphs), compareGlyphs);
+  if (font.kerning) {
+    int capacity = 0;
+    for (i = 0; i < n; i++) {
+      for (j = 0; j < n; j++) {
+        unsigned a = glyphs[i].codepoint, b = glyphs[j].codepoint;
+        float k = font_getKerning(&font, a, b);
+        if (k == 0) continue;
+        if (nkern == capacity) {
+          capacity = capacity ? capacity << 1 : 256;
+          kerning = dmt_realloc(kerning, capacity * sizeof(*kerning));
+        }
+        kerning[nkern].a = a;
+        kerning[nkern].b = b;
+        kerning[nkern].kern = k;
+        nkern++;
+      }
+    }
+  }
+
+  /* Write file */
+  header_t h;
+  h.magic = MAGIC;
+  h.version = VERSION;
+  h.height = font.height;
+  h.pageSize = font.pageSize;
+  h.pageCount = font.pageCount;
+  h.glyphCount = n;
+  h.kernCount = nkern;
+  int pagebytes = font.pageSize * font.pageSize / 8;
+  bits = dmt_malloc(pagebytes);
+  fp = fopen(outfile, "wb");
+  if (!fp) {
+    errmsg = "could not open output file";
+    goto cleanup;
+  }
+  int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+           fwrite(glyphs, sizeof(*glyphs), n, fp) == (unsigned) n &&
+           fwrite(kerning, sizeof(*kerning), nkern, fp) == (unsigned) nkern;
+  for (i = 0; ok && i < font.pageCount; i++) {
+    image_t *img = &font.pages[i];
+    memset(bits, 0, pagebytes);
+    for (j = 0; j < font.pageSize * font.pageSize; j++) {
+      if (img->data[j]) bits[j >> 3] |= 1 << (j & 7);
+    }
+    ok = fwrite(bits, 1, pagebytes, fp) == (unsigned) pagebytes;
+  }
+  if (!ok) {
+    errmsg = "failed when writing to output file";
+  }
+
+cleanup:
+  dmt_free(glyphs);
+  dmt_free(kerning);
+  font_deinit(&font);
+end:
+  dmt_free(bits);
+  if (fp) fclose(fp);
+  return errmsg;
+}
+
+
 void font_deinit(font_t *self) {
-  image_deinit(&self->image);
+  int i;
+  for (i = 0; i < self->pageCount; i++) {
+    image_deinit(&self->pages[i]);
+  }
+  dmt_free(self->pages);
+  dmt_free(self->glyphs);
+  dmt_free(self->kerning);
+  dmt_free(self->kernPairs);
+  filesystem_free(self->data);
+}
+
+
+unsigned font_utf8Next(const char **p) {
+  /* Decodes the UTF-8 codepoint at `*p` and advances `*p` past it. Invalid
+   * sequences decode to U+FFFD a byte at a time */
+  const unsigned char *s = (const unsigned char*) *p;
+  unsigned c = *s++;
+  int n;
+  if (c < 0x80) {
+    n = 0;
+  } else if (c >= 0xc0 && c < 0xe0) {
+    c &= 0x1f; n = 1;
+  } else if (c >= 0xe0 && c < 0xf0) {
+    c &= 0x0f; n = 2;
+  } else if (c >= 0xf0 && c < 0xf8) {
+    c &= 0x07; n = 3;
+  } else {
+    *p = (const char*) s;
+    return 0xfffd;
+  }
+  while (n--) {
+    if ((*s & 0xc0) != 0x80) {
+      *p = *p + 1;
+      return 0xfffd;
+    }
+    c = (c << 6) | (*s++ & 0x3f);
+  }
+  *p = (const char*) s;
+  return c;
+}
+
+
+static void bakeGlyph(font_t *self, font_glyph_t *glyph) {
+  /* Rasterizes the glyph into the last page, packing glyphs into rows as
+   * stbtt_BakeFontBitmap() does. Fonts without a ttf, which have all their
+   * glyphs loaded up front, use the U+FFFD or `?` glyph for any others */
+  if (!self->info.data) {
+    font_glyph_t *f = findSlot(self, 0xfffd);
+    if (f->codepoint == -1 || f == glyph) f = findSlot(self, '?');
+    if (f->codepoint != -1 && f != glyph) {
+      glyph->page = f->page;
+      glyph->c = f->c;
+    } else {
+      glyph->page = 0;
+      memset(&glyph->c, 0, sizeof(glyph->c));
+    }
+    return;
+  }
+  stbtt_fontinfo *f = &self->info;
+  int g = stbtt_FindGlyphIndex(f, glyph->codepoint);
+  int advance, lsb, x0, y0, x1, y1;
+  stbtt_GetGlyphHMetrics(f, g, &advance, &lsb);
+  stbtt_GetGlyphBitmapBox(f, g, self->scale, self->scale, &x0, &y0, &x1, &y1);
+  int gw = x1 - x0;
+  int gh = y1 - y0;
+  stbtt_bakedchar *c = &glyph->c;
+  memset(c, 0, sizeof(*c));
+  c->xadvance = self->scale * advance;
+  c->xoff = x0;
+  c->yoff = y0 + self->ascent;
+  if (gw <= 0 || gh <= 0 || gw + 2 > self->pageSize || gh + 2 > self->pageSize) {
+    /* Blank or too large to fit on a page */
+    glyph->page = 0;
+    return;
+  }
+
+  /* Find space for the glyph, adding a page if the last one is full */
+  if (self->pageCount == 0) addPage(self);
+  if (self->shelfX + gw + 1 >= self->pageSize) {
+    self->shelfX = 1;
+    self->shelfY = self->shelfBottom;
+  }
+  if (self->shelfY + gh + 1 >= self->pageSize) addPage(self);
+  int x = self->shelfX;
+  int y = self->shelfY;
+  self->shelfX += gw + 1;
+  if (y + gh + 1 > self->shelfBottom) self->shelfBottom = y + gh + 1;
+
+  /* Rasterize and threshold the glyph's pixels and set its mask */
+  image_t *img = &self->pages[self->pageCount - 1];
+  int stride = img->stride;
+  stbtt_MakeGlyphBitmap(f, img->data + x + y * stride, gw, gh, stride,
+                        self->scale, self->scale, g);
+  int i, j;
+  for (j = y; j < y + gh; j++) {
+    for (i = x; i < x + gw; i++) {
+      int k = i + j * stride;
+      img->data[k] = (img->data[k] > 127) ? 1 : 0;
+      img->mask[k] = (img->data[k] == 0) ? 0xff : 0;
+    }
+  }
+  image_discardSpans(img);
+  glyph->page = self->pageCount - 1;
+  c->x0 = x;
+  c->y0 = y;
+  c->x1 = x + gw;
+  c->y1 = y + gh;
+}
+
+
+font_glyph_t *font_getGlyph(font_t *self, unsigned codepoint) {
+  /* Returns the codepoint's glyph, rasterizing it if this is the first time
+   * it has been used. The pointer is only valid until the next call */
+  if (codepoint > 0x10ffff) codepoint = 0xfffd;
+  font_glyph_t *g = findSlot(self, codepoint);
+  if (g->codepoint != -1) {
+    return g;
+  }
+  g = addGlyph(self, codepoint);
+  bakeGlyph(self, g);
+  return g;
+}
+
+
+static int compareKerning(const void *a, const void *b) {
+  const font_kern_t *x = a, *y = b;
+  if (x->a != y->a) return x->a < y->a ? -1 : 1;
+  if (x->b != y->b) return x->b < y->b ? -1 : 1;
+  return 0;
+}
+
+
+float font_getKerning(font_t *self, unsigned a, unsigned b) {
+  /* Returns the kerning adjustment in pixels of the codepoint `b` following
+   * the codepoint `a`, or 0 if `a` is 0 */
+  if (!a) return 0;
+  if (self->kernPairs) {
+    font_kern_t key, *k;
+    key.a = a;
+    key.b = b;
+    k = bsearch(&key, self->kernPairs, self->kernCount, sizeof(key),
+                compareKerning);
+    return k ? k->kern : 0;
+  }
+  if (!self->kerning) return 0;
+  unsigned i = (hashCodepoint(a ^ (b * 31)) >> 8) & (FONT_KERN_CACHE - 1);
+  font_kern_t *k = &self->kerning[i];
+  if (k->a != a || k->b != b) {
+    k->a = a;
+    k->b = b;
+    k->kern = self->scale * stbtt_GetCodepointKernAdvance(&self->info, a, b);
+  }
+  return k->kern;
+}
+
+
+static int measure(font_t *self, const char *p, const char *end) {
+  /* Returns the width of the text [p, end), which must not contain a
+   * newline */
+  int x = 0;
+  unsigned c, prev = 0;
+  while (p < end) {
+    c = font_utf8Next(&p);
+    x += font_getKerning(self, prev, c);
+    x += font_getGlyph(self, c)->c.xadvance;
+    prev = c;
+  }
+  return x;
+}
+
+
+int font_getWidth(font_t *self, const char *str) {
+  /* Returns the width of the widest line of the string */
+  int width = 0;
+  const char *p = str;
+  for (;;) {
+    const char *end = strchr(p, '\n');
+    if (!end) end = p + strlen(p);
+    int w = measure(self, p, end);
+    if (w > width) width = w;
+    if (!*end) break;
+    p = end + 1;
+  }
+  return width;
+}
+
+
+const char *font_wrapLine(font_t *self, const char *str, int limit,
+                          const char **end, int *width
+) {
+  /* Finds the line starting at `str` when the text is wrapped to `limit`
+   * pixels wide. Lines are broken at newlines and, where a line would be too
+   * wide, after the last word which fits or after the last character which
+   * fits if the line's first word doesn't. Sets `end` to the end of the
+   * line's text without trailing spaces and `width` to its width. Returns the
+   * start of the next line, or NULL if this is the last one */
+  const char *p = str;
+  const char *next = NULL;
+  const char *wordEnd = NULL;
+  int hasGlyph = 0;
+  int x = 0;
+  unsigned c, prev = 0;
+  while (*p && *p != '\n') {
+    const char *q = p;
+    c = font_utf8Next(&q);
+    if (c == ' ' && p > str && p[-1] != ' ') {
+      wordEnd = p;
+    }
+    x += font_getKerning(self, prev, c);
+    x += font_getGlyph(self, c)->c.xadvance;
+    if (c != ' ' && x > limit && hasGlyph) {
+      /* Break after the last word, or at this character if there isn't
+       * one, skipping the spaces at the break. Leading spaces alone never
+       * cause a break, so a line always holds at least one glyph */
+      next = wordEnd ? wordEnd : p;
+      break;
+    }
+    if (c != ' ') hasGlyph = 1;
+    prev = c;
+    p = q;
+  }
+  if (next) {
+    p = next;
+    while (*next == ' ') next++;
+    if (!*next) next = NULL;
+  } else {
+    next = *p ? p + 1 : NULL;
+  }
+  while (p > str && p[-1] == ' ') p--;
+  *end = p;
+  *width = measure(self, str, p);
+  return next;
 }
 
 
 extern int image_blendMode;
 extern int image_flip;
 
+static void blitLine(font_t *self, pixel_t *buf, int bufw, int bufh,
+                     const char *p, const char *end, int x, int y,
+                     int extra, int spaces
+) {
+  /* Blits the text [p, end), which must not contain a newline, with its top
+   * left at x, y. `extra` pixels are spread between the first `spaces`
+   * spaces for justified text */
+  unsigned c, prev = 0;
+  while (p < end) {
+    c = font_utf8Next(&p);
+    font_glyph_t *glyph = font_getGlyph(self, c);
+    stbtt_bakedchar *g = &glyph->c;
+    x += font_getKerning(self, prev, c);
+    int w = g->x1 - g->x0;
+    int h = g->y1 - g->y0;
+    if (w > 0 && h > 0) {
+      image_blit(&self->pages[glyph->page], buf, bufw, bufh,
+                 x + g->xoff, y + g->yoff, g->x0, g->y0, w, h);
+    }
+    x += g->xadvance;
+    if (c == ' ' && spaces > 0) {
+      int n = extra / spaces;
+      x += n;
+      extra -= n;
+      spaces--;
+    }
+    prev = c;
+  }
+}
+
+
 void font_blit(font_t *self, pixel_t *buf, int bufw, int bufh,
                const char *str, int dx, int dy
 ) {
   const char *p = str;
-  int x = dx;
   int y = dy;
 
   int oldBlendMode = image_blendMode;
   int oldFlip = image_flip;
-  image_blendMode = IMAGE_COLOR;
+  image_blendMode = self->colored ? IMAGE_NORMAL : IMAGE_COLOR;
   image_flip = 0;
 
-  while (*p) {
-    if (*p == '\n') {
-      x = dx;
-      y += self->height;
-    } else {
-      stbtt_bakedchar *g = &self->glyphs[(int) (*p & 127)];
-      int w = g->x1 - g->x0;
-      int h = g->y1 - g->y0;
-      image_blit(&self->image, buf, bufw, bufh,
-                 x + g->xoff, y + g->yoff, g->x0, g->y0, w, h);
-      x += g->xadvance;
+  for (;;) {
+    const char *end = strchr(p, '\n');
+    if (!end) end = p + strlen(p);
+    blitLine(self, buf, bufw, bufh, p, end, dx, y, 0, 0);
+    if (!*end) break;
+    p = end + 1;
+    y += self->height;
+  }
+
+  image_blendMode = oldBlendMode;
+  image_flip = oldFlip;
+}
+
+
+int font_printf(font_t *self, pixel_t *buf, int bufw, int bufh,
+                const char *str, int dx, int dy, int limit, int align
+) {
+  /* Blits the string wrapped to `limit` pixels wide with each line aligned
+   * within the limit; justified lines are stretched to the limit by widening
+   * their spaces, except for the last line of each paragraph. Returns the
+   * number of lines */
+  const char *p = str;
+  int y = dy;
+  int lines = 0;
+
+  int oldBlendMode = image_blendMode;
+  int oldFlip = image_flip;
+  image_blendMode = self->colored ? IMAGE_NORMAL : IMAGE_COLOR;
+  image_flip = 0;
+
+  while (p) {
+    const char *end;
+    int width;
+    const char *next = font_wrapLine(self, p, limit, &end, &width);
+    int x = dx, extra = 0, spaces = 0;
+    switch (align) {
+      case FONT_ALIGN_CENTER : x += (limit - width) / 2;  break;
+      case FONT_ALIGN_RIGHT  : x += limit - width;        break;
+      case FONT_ALIGN_JUSTIFY:
+        if (next && next[-1] != '\n') {
+          const char *q;
+          for (q = p; q < end; q++) spaces += (*q == ' ');
+          extra = limit - width;
+        }
+        break;
     }
-    p++;
+    blitLine(self, buf, bufw, bufh, p, end, x, y, extra, spaces);
+    lines++;
+    y += self->height;
+    p = next;
   }
 
   image_blendMode = oldBlendMode;
   image_flip = oldFlip;
+  return lines;
+}
+
+
+void font_getBounds(font_t *self, const char *str,
+                    int *x, int *y, int *w, int *h
+) {
+  /* Gets the rect covered by the glyphs of `str` when drawn at 0, 0 */
+  const char *p = str;
+  int gx = 0, gy = 0;
+  int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+  int empty = 1;
+  unsigned c, prev = 0;
+  while (*p) {
+    if (*p == '\n') {
+      gx = 0;
+      gy += self->height;
+      prev = 0;
+      p++;
+    } else {
+      c = font_utf8Next(&p);
+      stbtt_bakedchar *g = &font_getGlyph(self, c)->c;
+      gx += font_getKerning(self, prev, c);
+      int left = gx + g->xoff;
+      int top = gy + g->yoff;
+      int right = left + g->x1 - g->x0;
+      int bottom = top + g->y1 - g->y0;
+      if (left == right || top == bottom) {
+        /* Blank glyph */
+      } else if (empty) {
+        x0 = left; y0 = top; x1 = right; y1 = bottom;
+        empty = 0;
+      } else {
+        if (left < x0) x0 = left;
+        if (top < y0) y0 = top;
+        if (right > x1) x1 = right;
+        if (bottom > y1) y1 = bottom;
+      }
+      gx += g->xadvance;
+      prev = c;
+    }
+  }
+  *x = x0;
+  *y = y0;
+  *w = x1 - x0;
+  *h = y1 - y0;
 }
@@ -12,16 +12,72 @@
 #include "lib/stb/stb_truetype.h"
 
 typedef struct {
-  image_t image;
-  stbtt_bakedchar glyphs[128];
+  int codepoint;
+  int page;
+  stbtt_bakedchar c;
+} font_glyph_t;
+
+enum {
+  FONT_ALIGN_LEFT,
+  FONT_ALIGN_CENTER,
+  FONT_ALIGN_RIGHT,
+  FONT_ALIGN_JUSTIFY,
+};
+
+#define FONT_KERN_CACHE 256
+
+typedef struct {
+  unsigned a, b;
+  float kern;
+} font_kern_t;
+
+typedef struct {
+  stbtt_fontinfo info;
+  void *data;
+  float scale;
+  int ascent;
+  image_t *pages;
+  int pageCount, pageSize;
+  int shelfX, shelfY, shelfBottom;
+  font_glyph_t *glyphs;
+  int glyphCount, glyphCapacity;
+  font_kern_t *kerning;
+  font_kern_t *kernPairs;
+  int kernCount;
+  int colored;
   int height;
 } font_t;
 
+/* Glyphs are rasterized the first time they are used and packed into the
+ * last of the `pages`, a new page being added when it is full. `glyphs` is a
+ * hashmap of the rasterized glyphs keyed by codepoint; a `codepoint` of -1
+ * marks an empty slot. `kerning` is a cache of FONT_KERN_CACHE recently used
+ * kerning pairs, or NULL if the font has no kerning. Fonts loaded from a baked
+ * font file instead hold all their kerning in the sorted `kernPairs` array.
+ * `data` is the ttf file's data if it is owned by the font; fonts without a
+ * ttf have `info.data` set to NULL and all their glyphs loaded up front. If
+ * `colored` is set the glyphs are drawn in their own colors rather than the
+ * current color */
+
 const char *font_init(font_t *self, const char *filename, int ptsize);
 const char *font_initEmbedded(font_t *self, int ptsize);
+const char *font_initImage(font_t *self, const char *filename,
+                           const char *glyphs, int spacing);
+const char *font_bake(const char *filename, int ptsize, const char *chars,
+                      const char *outfile);
 void font_deinit(font_t *self);
+unsigned font_utf8Next(const char **p);
+font_glyph_t *font_getGlyph(font_t *self, unsigned codepoint);
+float font_getKerning(font_t *self, unsigned a, unsigned b);
+int font_getWidth(font_t *self, const char *str);
+const char *font_wrapLine(font_t *self, const char *str, int limit,
+                          const char **end, int *width);
 void font_blit(font_t *self, pixel_t *buf, int bufw, int bufh,
                const char *str, int dx, int dy);
+int font_printf(font_t *self, pixel_t *buf, int bufw, int bufh,
+                const char *str, int dx, int dy, int limit, int align);
+void font_getBounds(font_t *self, const char *str,
+                    int *x, int *y, int *w, int *h);
 
 
 #endif
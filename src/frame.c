@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <dpmi.h>
+
+#include "vga.h"
+#include "frame.h"
+
+/* Frames are paced by waiting before each is presented until it is due, the
+ * CPU being yielded while waiting. If the target rate is set then each frame
+ * is due a period after the last; a frame which is already overdue before it
+ * is drawn can have its drawing skipped so the game catches up by running
+ * updates alone. The wait can also be extended to the start of the next vertical
+ * retrace, or of a simulated 70Hz retrace timed by the clock, which behaves
+ * the same without touching the VGA registers */
+
+#define SIMULATED_RATE 70
+
+int frame_vsync;
+int frame_maxSkip;
+int frame_skipCount;
+long long frame_period;
+long long frame_next;
+frame_stats_t frame_stats;
+
+
+void frame_setVSync(int mode) {
+  frame_vsync = mode;
+}
+
+
+int frame_getVSync(void) {
+  return frame_vsync;
+}
+
+
+void frame_setTargetFPS(double fps) {
+  /* Sets the rate frames are limited to; 0 removes the limit */
+  frame_period = fps > 0 ? UCLOCKS_PER_SEC / fps : 0;
+  frame_next = 0;
+}
+
+
+double frame_getTargetFPS(void) {
+  return frame_period ? UCLOCKS_PER_SEC / (double) frame_period : 0;
+}
+
+
+void frame_setMaxSkip(int count) {
+  /* Sets the most frames in a row which can have their drawing skipped */
+  frame_maxSkip = count > 0 ? count : 0;
+}
+
+
+int frame_getMaxSkip(void) {
+  return frame_maxSkip;
+}
+
+
+int frame_shouldDraw(void) {
+  /* Returns 0 if the current frame's drawing should be skipped as it is
+   * already overdue, in which case its time is given up */
+  if (frame_period && frame_next && frame_skipCount < frame_maxSkip &&
+      uclock() > frame_next
+  ) {
+    frame_next += frame_period;
+    frame_skipCount++;
+    frame_stats.skipped++;
+    return 0;
+  }
+  frame_skipCount = 0;
+  return 1;
+}
+
+
+static void waitUntil(long long t) {
+  while (uclock() < t) {
+    __dpmi_yield();
+  }
+}
+
+
+void frame_wait(void) {
+  /* Waits until the frame is due to be presented */
+  long long start = uclock();
+  if (frame_period) {
+    /* Restart the schedule on the first frame or if too far behind to catch
+     * up by skipping frames */
+    long long limit = frame_period * (frame_maxSkip + 1);
+    if (!frame_next || start > frame_next + limit) {
+      frame_next = start;
+    }
+    waitUntil(frame_next);
+    frame_next += frame_period;
+  }
+  if (frame_vsync == FRAME_VSYNC_ON) {
+    vga_waitRetrace();
+  } else if (frame_vsync == FRAME_VSYNC_SIMULATED) {
+    long long rate = UCLOCKS_PER_SEC / SIMULATED_RATE;
+    waitUntil((uclock() / rate + 1) * rate);
+  }
+  frame_stats.lastWait = (uclock() - start) / (double) UCLOCKS_PER_SEC;
+  frame_stats.waitTime += frame_stats.lastWait;
+  frame_stats.drawn++;
+}
+
+
+void frame_getStats(frame_stats_t *stats) {
+  *stats = frame_stats;
+}
+
+
+void frame_resetStats(void) {
+  memset(&frame_stats, 0, sizeof(frame_stats));
+}
@@ -0,0 +1,33 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+enum {
+  FRAME_VSYNC_OFF,
+  FRAME_VSYNC_ON,
+  FRAME_VSYNC_SIMULATED,
+};
+
+typedef struct {
+  unsigned drawn, skipped;
+  double waitTime, lastWait;
+} frame_stats_t;
+
+void frame_setVSync(int mode);
+int frame_getVSync(void);
+void frame_setTargetFPS(double fps);
+double frame_getTargetFPS(void);
+void frame_setMaxSkip(int count);
+int frame_getMaxSkip(void);
+int frame_shouldDraw(void);
+void frame_wait(void);
+void frame_getStats(frame_stats_t *stats);
+void frame_resetStats(void);
+
+#endif
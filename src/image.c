@@ -8,16 +8,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
 
 #include "lib/dmt/dmt.h"
 #include "lib/stb/stb_image.h"
 #include "filesystem.h"
 #include "image.h"
+#include "blend.h"
+#include "imagecache.h"
+#include "quantize.h"
 #include "palette.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  #define IMAGE_MMX
+  #include <cpuid.h>
+  #include <mmintrin.h>
+#endif
+
 int image_blendMode = IMAGE_NORMAL;
 int image_flip = 0;
 unsigned int image_color = 0x0f0f0f0f;
+image_rect_t image_clip = { 0, 0, INT_MAX, INT_MAX };
+const pixel_t *image_remap = NULL;
+int image_derivedMasks = 0;
+
+#define BSWAP32(x) __builtin_bswap32(x)
+
+/* Images with a NULL mask derive it from their data: pixels of 0 are
+ * transparent. These get the mask of a single pixel or of 4 pixels packed
+ * into a word; a byte's top bit is set by the add if any of its low 7 bits
+ * are set */
+#define DERIVE_MASK(p)    ((pixel_t) -((p) == 0))
+#define DERIVE_MASK32(p)\
+  (~(((((((p) & 0x7f7f7f7f) + 0x7f7f7f7f) | (p)) & 0x80808080) >> 7) * 0xff))
+#define MASK_AT(img, i)\
+  ((img)->mask ? (img)->mask[i] : DERIVE_MASK((img)->data[i]))
 
 
 void image_setBlendMode(int mode) {
@@ -32,13 +58,54 @@ void image_setFlip(int mode) {
   image_flip = !!mode;
 }
 
+void image_setRemap(const pixel_t *remap) {
+  /* Sets the 256 entry table which source pixels are passed through when
+   * blitting; NULL removes the remap */
+  image_remap = remap;
+}
+
+void image_setDerivedMasks(int enable) {
+  /* Sets whether image_init() loads images without a mask, the mask instead
+   * being derived from the image's data when blitting */
+  image_derivedMasks = !!enable;
+}
+
+int image_getDerivedMasks(void) {
+  return image_derivedMasks;
+}
+
+void image_setClip(const image_rect_t *rect) {
+  /* Sets the rect which blits are clipped to in addition to the destination
+   * buffer's bounds; NULL removes the clip rect */
+  if (rect) {
+    image_clip = *rect;
+  } else {
+    image_clip.x0 = image_clip.y0 = 0;
+    image_clip.x1 = image_clip.y1 = INT_MAX;
+  }
+}
+
+void image_getClip(image_rect_t *rect) {
+  *rect = image_clip;
+}
+
+static void getClip(int bufw, int bufh, image_rect_t *r) {
+  /* Gets the intersection of the destination buffer and the clip rect */
+  r->x0 = image_clip.x0 > 0 ? image_clip.x0 : 0;
+  r->y0 = image_clip.y0 > 0 ? image_clip.y0 : 0;
+  r->x1 = image_clip.x1 < bufw ? image_clip.x1 : bufw;
+  r->y1 = image_clip.y1 < bufh ? image_clip.y1 : bufh;
+}
+
 
 
 const char *image_init(image_t *self, const char *filename) {
-  /* Loads an image file into the struct and inits the mask */
+  /* Loads an image file into the struct and inits the mask, unless masks are
+   * being derived from the data */
   const char *errmsg = NULL;
   void *filedata = NULL;
   unsigned char *data32 = NULL;
+  pixel_t *cached = NULL;
   memset(self, 0, sizeof(*self));
 
   /* Load file data */
@@ -49,55 +116,90 @@ const char *image_init(image_t *self, const char *filename) {
     goto fail;
   }
 
-  /* Load 32bit image data */
+  /* Use the already paletted pixels from the image cache if we have them,
+   * else load 32bit image data. The cache isn't used while quantizing as it
+   * holds the image's exact colors */
   int width, height, n;
-  data32 = stbi_load_from_memory(filedata, size, &width, &height, &n, 4);
-  if (!data32) {
-    errmsg = "could not load image file";
-    goto fail;
+  int quantizing = quantize_isEnabled();
+  if (!quantizing) {
+    cached = imagecache_load(filename, filedata, size, &width, &height);
+  }
+  if (!cached) {
+    data32 = stbi_load_from_memory(filedata, size, &width, &height, &n, 4);
+    if (!data32) {
+      errmsg = "could not load image file";
+      goto fail;
+    }
   }
 
-  /* Free file data */
-  filesystem_free(filedata);
-  filedata = NULL;
-
-  /* Set dimensions and allocate memory */
+  /* Set dimensions and allocate memory; if atlasing is enabled the image is
+   * packed into an atlas page if it fits */
   int sz = width * height;
   self->width = width;
   self->height = height;
-  self->data = dmt_malloc(sz);
+  self->stride = width;
+  pixel_t **mask = image_derivedMasks ? NULL : &self->mask;
+  if (atlas_isEnabled()) {
+    self->page = atlas_alloc(width, height, &self->data, mask);
+    if (self->page) self->stride = ATLAS_PAGE_SIZE;
+  }
+  if (!self->page) {
+    self->data = dmt_malloc(sz);
+    if (mask) *mask = dmt_malloc(sz);
+  }
 
-  /* Load pixels into struct, converting 32bit to 8bit paletted */
-  int i;
-  for (i = 0; i < width * height; i++) {
-    unsigned char *p = data32 + i * 4;
-    int r = p[0];
-    int g = p[1];
-    int b = p[2];
-    int a = p[3];
-    int idx = palette_colorToIdx(r, g, b);
-    if (idx < 0) {
-      errmsg = "color palette exhausted: use fewer unique colors";
-      goto fail;
+  /* Load pixels into struct, converting 32bit to 8bit paletted, and init
+   * mask */
+  int x, y;
+  for (y = 0; y < height; y++) {
+    pixel_t *dst = self->data + y * self->stride;
+    if (cached) {
+      memcpy(dst, cached + y * width, width);
+    } else if (quantizing) {
+      quantize_mapRow(dst, data32 + y * width * 4, width, y);
+    } else {
+      for (x = 0; x < width; x++) {
+        unsigned char *p = data32 + (x + y * width) * 4;
+        int r = p[0];
+        int g = p[1];
+        int b = p[2];
+        int a = p[3];
+        int idx = palette_colorToIdx(r, g, b);
+        if (idx < 0) {
+          errmsg = "color palette exhausted: use fewer unique colors";
+          goto fail;
+        }
+        dst[x] = (a >= 127) ? idx : 0;
+      }
+    }
+    if (self->mask) {
+      pixel_t *msk = self->mask + y * self->stride;
+      for (x = 0; x < width; x++) {
+        msk[x] = (dst[x] == 0) ? 0xFF : 0x00;
+      }
     }
-    self->data[i] = (a >= 127) ? idx : 0;
   }
 
-  /* Init mask */
-  self->mask = dmt_malloc(sz);
-  for (i = 0; i < sz; i++) {
-    self->mask[i] = (self->data[i] == 0) ? 0xFF : 0x00;
+  /* Write the cache file if the image wasn't loaded from it */
+  if (!cached && !quantizing) {
+    imagecache_save(filename, filedata, size,
+                    self->data, width, height, self->stride);
   }
 
-  /* Free 32bit pixel data, return NULL for no error */
+  /* Init span encoding */
+  image_initSpans(self);
+
+  /* Free file data and 32bit pixel data, return NULL for no error */
+  filesystem_free(filedata);
   free(data32);
-  data32 = NULL;
+  dmt_free(cached);
 
   return NULL;
 
 fail:
   filesystem_free(filedata);
   free(data32);
+  dmt_free(cached);
   return errmsg;
 }
 
@@ -109,11 +211,367 @@ void image_initBlank(image_t *self, int width, int height) {
   self->data = dmt_calloc(1, width * height);
   self->width = width;
   self->height = height;
+  self->stride = width;
   /* Init mask */
   self->mask = dmt_calloc(1, width * height);
 }
 
 
+void image_initView(image_t *self, image_t *parent,
+                    int x, int y, int width, int height) {
+  /* Inits the image as a view of the given rect of the parent's pixels; the
+   * rect must be within the parent, which must outlive the view. A view of a
+   * view shares the pixels of the outermost parent */
+  memset(self, 0, sizeof(*self));
+  int offset = x + y * parent->stride;
+  self->data = parent->data + offset;
+  self->mask = parent->mask ? parent->mask + offset : NULL;
+  self->width = width;
+  self->height = height;
+  self->stride = parent->stride;
+  self->parent = parent->parent ? parent->parent : parent;
+  image_initSpans(self);
+}
+
+
+static void freeSpans(image_t *self) {
+  dmt_free(self->spans);
+  self->spans = NULL;
+}
+
+
+void image_initSpans(image_t *self) {
+  /* Builds the run-length span encoding of the image from its mask. The
+   * encoding is only kept if the image's runs are long enough on average for
+   * it to be faster than the masked blit */
+  int x, y, n = 0;
+  freeSpans(self);
+  if (self->parent) self->parentChanges = self->parent->changes;
+  if (self->width > 0xffff) return;
+  #define TRANSPARENT(x) (self->mask ? p[x] : !p[x])
+  pixel_t *rows = self->mask ? self->mask : self->data;
+
+  /* Count runs */
+  for (y = 0; y < self->height; y++) {
+    pixel_t *p = rows + y * self->stride;
+    x = 0;
+    while (x < self->width) {
+      while (x < self->width && TRANSPARENT(x)) x++;
+      while (x < self->width && !TRANSPARENT(x)) x++;
+      n++;
+    }
+  }
+  if (n * 8 > self->width * self->height) return;
+
+  /* Build row offsets and runs */
+  self->spans = dmt_malloc(self->height * sizeof(int) + n * 4);
+  unsigned short *run = (unsigned short*) (self->spans + self->height);
+  n = 0;
+  for (y = 0; y < self->height; y++) {
+    pixel_t *p = rows + y * self->stride;
+    self->spans[y] = n;
+    x = 0;
+    while (x < self->width) {
+      int start = x;
+      while (x < self->width && TRANSPARENT(x)) x++;
+      run[n++] = x - start;
+      start = x;
+      while (x < self->width && !TRANSPARENT(x)) x++;
+      run[n++] = x - start;
+    }
+  }
+  #undef TRANSPARENT
+}
+
+
+void image_discardSpans(image_t *self) {
+  /* Frees the span encoding; this must be called whenever the image's pixels
+   * are changed. As a view shares its parent's pixels the parent's spans are
+   * discarded too, which in turn invalidates the spans of its other views */
+  freeSpans(self);
+  self->changes++;
+  if (self->parent) image_discardSpans(self->parent);
+}
+
+
+static void copyReversed(pixel_t *dst, const pixel_t *src, int n) {
+  /* Copies `n` pixels ending at `src` to `dst` in reverse order, 4 pixels at a
+   * time where possible */
+  while (n >= 4) {
+    src -= 4;
+    *(unsigned int*)dst = BSWAP32(*(unsigned int*)src);
+    dst += 4;
+    n -= 4;
+  }
+  while (n--) *dst++ = *--src;
+}
+
+
+static void blitSpans(image_t *self, pixel_t *buf, int bufw,
+                      int dx, int dy, int sx, int sy, int sw, int sh
+) {
+  /* Blits the already-clipped rect using the span encoding: opaque runs are
+   * copied (or filled in IMAGE_COLOR mode), transparent runs are skipped */
+  int y, ex = sx + sw;
+  for (y = 0; y < sh; y++) {
+    unsigned short *run = IMAGE_SPANROW(self, sy + y);
+    pixel_t *src = self->data + (sy + y) * self->stride;
+    pixel_t *dst = buf + dx + (dy + y) * bufw;
+    int x = 0;
+    while (x < ex) {
+      int a = x + run[0];
+      int b = a + run[1];
+      run += 2;
+      x = b;
+      if (a < sx) a = sx;
+      if (b > ex) b = ex;
+      if (a >= b) continue;
+      if (image_blendMode == IMAGE_COLOR) {
+        memset(dst + (image_flip ? ex - b : a - sx), image_color, b - a);
+      } else if (!image_flip) {
+        memcpy(dst + a - sx, src + a, b - a);
+      } else {
+        copyReversed(dst + ex - b, src + b, b - a);
+      }
+    }
+  }
+}
+
+
+#define BLIT_FAST(dst, src, msk)\
+  (dst) = (src);
+
+#define BLIT_NORMAL(dst, src, msk)\
+  (dst) &= (msk);\
+  (dst) |= (src);
+
+#define BLIT_AND(dst, src, msk)\
+  (dst) &= (src);
+
+#define BLIT_OR(dst, src, msk)\
+  (dst) |= (src);
+
+#define BLIT_COLOR(dst, src, msk)\
+  (dst) &= (msk);\
+  (dst) |= ~(msk) & image_color;
+
+/* Lookup table blend modes work a single pixel at a time using the table set
+ * by getLookup() */
+#define BLIT_TABLE(dst, src, msk)\
+  if (!(msk)) (dst) = image_lookup[((src) << 8) | (dst)];
+
+#define BLIT_SHADE(dst, src, msk)\
+  if (!(msk)) (dst) = image_lookup[(src)];
+
+/* Switch for loops which work a single pixel at a time */
+#define BLIT_PIXELS(loop)\
+  switch (image_blendMode) {\
+    default:\
+    case IMAGE_NORMAL : loop(BLIT_NORMAL)     break;\
+    case IMAGE_FAST   : loop(BLIT_FAST)       break;\
+    case IMAGE_AND    : loop(BLIT_AND)        break;\
+    case IMAGE_OR     : loop(BLIT_OR)         break;\
+    case IMAGE_COLOR  : loop(BLIT_COLOR)      break;\
+    case IMAGE_TRANSLUCENT :\
+    case IMAGE_ADD    : loop(BLIT_TABLE)      break;\
+    case IMAGE_DARKEN :\
+    case IMAGE_TINT   : loop(BLIT_SHADE)      break;\
+  }
+
+static const pixel_t *image_lookup;
+
+static int getLookup(void) {
+  /* Sets `image_lookup` to the table used by the current blend mode, returns
+   * 0 if the blend mode doesn't use one */
+  switch (image_blendMode) {
+    case IMAGE_TRANSLUCENT:
+      image_lookup = blend_getTable(BLEND_TRANSLUCENT);
+      return 1;
+    case IMAGE_ADD:
+      image_lookup = blend_getTable(BLEND_ADD);
+      return 1;
+    case IMAGE_DARKEN:
+      image_lookup = blend_getRemap(BLEND_DARKEN, image_color);
+      return 1;
+    case IMAGE_TINT:
+      image_lookup = blend_getRemap(BLEND_TINT, image_color);
+      return 1;
+  }
+  return 0;
+}
+
+
+static const pixel_t *getRemap(void) {
+  /* Returns the table source pixels are passed through, this is an identity
+   * table if no remap is set */
+  static pixel_t identity[256];
+  if (image_remap) {
+    return image_remap;
+  }
+  if (!identity[255]) {
+    int i;
+    for (i = 0; i < 256; i++) identity[i] = i;
+  }
+  return identity;
+}
+
+
+static void blitPixels(image_t *self, pixel_t *buf, int bufw,
+                       int dx, int dy, int sx, int sy, int sw, int sh
+) {
+  /* Blits the already-clipped rect a pixel at a time, passing each source
+   * pixel through the remap table; used when a remap is set or the blend mode
+   * uses a lookup table */
+  const pixel_t *remap = getRemap();
+  #define PIXEL_LOOP(func)\
+    {\
+      int x, y;\
+      int step = image_flip ? -1 : 1;\
+      for (y = 0; y < sh; y++) {\
+        int srci = sx + (image_flip ? sw - 1 : 0) + (sy + y) * self->stride;\
+        pixel_t *dst = buf + dx + (dy + y) * bufw;\
+        for (x = 0; x < sw; x++) {\
+          func(dst[x], remap[self->data[srci]], MASK_AT(self, srci))\
+          srci += step;\
+        }\
+      }\
+    }
+  BLIT_PIXELS(PIXEL_LOOP);
+  #undef PIXEL_LOOP
+}
+
+
+/* Row kernels used for unflipped blits; a NULL entry means the blend mode uses
+ * the scalar blit loop. These are set by image_initKernels() */
+typedef void (*blitRow_t)(pixel_t*, const pixel_t*, const pixel_t*, int);
+static blitRow_t blitRows[IMAGE_COLOR + 1];
+
+#ifdef IMAGE_MMX
+
+#define MMX_NORMAL(dst, src, msk)\
+  (dst) = _mm_or_si64(_mm_and_si64((dst), (msk)), (src));
+
+#define MMX_AND(dst, src, msk)\
+  (dst) = _mm_and_si64((dst), (src));
+
+#define MMX_OR(dst, src, msk)\
+  (dst) = _mm_or_si64((dst), (src));
+
+#define MMX_COLOR(dst, src, msk)\
+  (dst) = _mm_or_si64(_mm_and_si64((dst), (msk)),\
+                      _mm_andnot_si64((msk), _mm_set1_pi8(image_color)));
+
+#define MMX_KERNEL(name, func, scalar)\
+  static __attribute__((target("mmx")))\
+  void name(pixel_t *dst, const pixel_t *src, const pixel_t *msk, int n) {\
+    while (n >= 16) {\
+      __m64 d0 = *(__m64*) dst;\
+      __m64 d1 = *(__m64*) (dst + 8);\
+      func(d0, *(__m64*) src, *(__m64*) msk)\
+      func(d1, *(__m64*) (src + 8), *(__m64*) (msk + 8))\
+      *(__m64*) dst = d0;\
+      *(__m64*) (dst + 8) = d1;\
+      dst += 16; src += 16; msk += 16; n -= 16;\
+    }\
+    if (n >= 8) {\
+      __m64 d0 = *(__m64*) dst;\
+      func(d0, *(__m64*) src, *(__m64*) msk)\
+      *(__m64*) dst = d0;\
+      dst += 8; src += 8; msk += 8; n -= 8;\
+    }\
+    while (n--) {\
+      scalar(*dst, *src, *msk)\
+      dst++; src++; msk++;\
+    }\
+  }
+
+MMX_KERNEL(mmxRowNormal,  MMX_NORMAL, BLIT_NORMAL)
+MMX_KERNEL(mmxRowAnd,     MMX_AND,    BLIT_AND)
+MMX_KERNEL(mmxRowOr,      MMX_OR,     BLIT_OR)
+MMX_KERNEL(mmxRowColor,   MMX_COLOR,  BLIT_COLOR)
+
+
+static __attribute__((target("mmx"))) void mmxEnd(void) {
+  /* Leaves MMX state so the FPU can be used again */
+  _mm_empty();
+}
+
+
+static int checkKernels(const blitRow_t *rows) {
+  /* Checks the kernels bit-for-bit against the scalar blend functions for
+   * every row length and alignment up to 48 pixels. Returns 0 on mismatch */
+  pixel_t src[64], msk[64], dst[64], ref[64];
+  unsigned seed = 0x2f6b1a3d;
+  unsigned oldColor = image_color;
+  int mode, offset, n, i, ok = 1;
+  for (i = 0; i < 64; i++) {
+    seed = seed * 1103515245 + 12345;
+    src[i] = seed >> 16;
+    msk[i] = (seed >> 8) & 1 ? 0xff : 0x00;
+  }
+  image_setColor(seed >> 24);
+  for (mode = 0; mode <= IMAGE_COLOR; mode++) {
+    if (!rows[mode]) continue;
+    for (offset = 0; offset < 8; offset++) {
+      for (n = 0; n <= 48; n++) {
+        for (i = 0; i < 64; i++) dst[i] = ref[i] = i * 37;
+        rows[mode](dst + offset, src + 8 - offset, msk + offset, n);
+        for (i = offset; i < offset + n; i++) {
+          pixel_t s = src[i + 8 - offset * 2], m = msk[i];
+          switch (mode) {
+            case IMAGE_NORMAL : BLIT_NORMAL(ref[i], s, m)  break;
+            case IMAGE_AND    : BLIT_AND(ref[i], s, m)     break;
+            case IMAGE_OR     : BLIT_OR(ref[i], s, m)      break;
+            case IMAGE_COLOR  : BLIT_COLOR(ref[i], s, m)   break;
+          }
+        }
+        if (memcmp(dst, ref, sizeof(dst))) ok = 0;
+      }
+    }
+  }
+  mmxEnd();
+  image_color = oldColor;
+  return ok;
+}
+
+#endif
+
+
+void image_initKernels(void) {
+  /* Selects the fastest row kernels the CPU supports, falling back to the
+   * scalar blit loops */
+  memset(blitRows, 0, sizeof(blitRows));
+#ifdef IMAGE_MMX
+  unsigned a, b, c, d;
+  if (__get_cpuid(1, &a, &b, &c, &d) && (d & bit_MMX)) {
+    blitRow_t rows[IMAGE_COLOR + 1] = { NULL };
+    rows[IMAGE_NORMAL] = mmxRowNormal;
+    rows[IMAGE_AND]    = mmxRowAnd;
+    rows[IMAGE_OR]     = mmxRowOr;
+    rows[IMAGE_COLOR]  = mmxRowColor;
+    if (checkKernels(rows)) {
+      memcpy(blitRows, rows, sizeof(blitRows));
+    }
+  }
+#endif
+}
+
+
+static void blitKernel(blitRow_t row, image_t *self, pixel_t *buf, int bufw,
+                       int dx, int dy, int sx, int sy, int sw, int sh
+) {
+  /* Blits the already-clipped rect a row at a time using a row kernel */
+  int y;
+  for (y = 0; y < sh; y++) {
+    int srci = sx + (sy + y) * self->stride;
+    row(buf + dx + (dy + y) * bufw, self->data + srci, self->mask + srci, sw);
+  }
+#ifdef IMAGE_MMX
+  mmxEnd();
+#endif
+}
+
+
 void image_blit(image_t *self, pixel_t *buf, int bufw, int bufh,
                 int dx, int dy, int sx, int sy, int sw, int sh
 ) {
@@ -125,39 +583,69 @@ void image_blit(image_t *self, pixel_t *buf, int bufw, int bufh,
   if ((diff = (sx + sw) - self->width) > 0) { sw -= diff; }
   if ((diff = (sy + sh) - self->height) > 0) { sh -= diff; }
 
-  /* Clip to destination buffer */
+  /* Clip to destination buffer and clip rect */
+  image_rect_t c;
+  getClip(bufw, bufh, &c);
   if (!image_flip) {
-    if ((diff = -dx) > 0) { sw -= diff; sx += diff; dx += diff; }
-    if ((diff = dx + sw - bufw) >= 0) { sw -= diff; }
+    if ((diff = c.x0 - dx) > 0) { sw -= diff; sx += diff; dx += diff; }
+    if ((diff = dx + sw - c.x1) >= 0) { sw -= diff; }
   } else {
-    if ((diff = -dx) > 0) { sw -= diff; dx += diff; }
-    if ((diff = dx + sw - bufw) >= 0) { sx += diff; sw -= diff; }
+    if ((diff = c.x0 - dx) > 0) { sw -= diff; dx += diff; }
+    if ((diff = dx + sw - c.x1) >= 0) { sx += diff; sw -= diff; }
   }
-  if ((diff = dy + sh - bufh) >= 0) { sh -= diff; }
-  if ((diff = -dy) > 0) { sh -= diff; sy += diff; dy += diff; }
+  if ((diff = dy + sh - c.y1) >= 0) { sh -= diff; }
+  if ((diff = c.y0 - dy) > 0) { sh -= diff; sy += diff; dy += diff; }
 
   /* Return early if we're clipped entirely off the dest / source */
   if (sw <= 0 || sh <= 0) return;
 
+  /* Drop a view's spans if its parent's pixels have changed since they were
+   * built */
+  if (self->spans && self->parent &&
+      self->parent->changes != self->parentChanges
+  ) {
+    freeSpans(self);
+  }
+
+  /* Use the span encoding if we have one and the blend mode ignores
+   * transparent pixels */
+  if (self->spans && !image_remap &&
+      (image_blendMode == IMAGE_NORMAL || image_blendMode == IMAGE_COLOR)
+  ) {
+    blitSpans(self, buf, bufw, dx, dy, sx, sy, sw, sh);
+    return;
+  }
+
+  /* Blit a pixel at a time if the blend mode has a lookup table or a remap
+   * is set */
+  if (getLookup() || image_remap) {
+    blitPixels(self, buf, bufw, dx, dy, sx, sy, sw, sh);
+    return;
+  }
+
   /* Blit */
-  #define BLIT_LOOP_NORMAL(func)\
+  /* The loops take whether the image's mask is derived from its data as a
+   * constant so that each case is compiled without the check */
+  #define BLIT_LOOP_NORMAL(func, derived)\
     {\
       int x, y;\
-      int srci = sx + sy * self->width;\
+      int srci = sx + sy * self->stride;\
       int dsti = dx + dy * bufw;\
-      int srcrowdiff = self->width - sw;\
+      int srcrowdiff = self->stride - sw;\
       int dstrowdiff = bufw - sw;\
       int sw32 = sw - (sw & 3);\
       for (y = 0; y < sh; y++) {\
         for (x = 0; x < sw32; x += 4) {\
-          func(*(unsigned int*)&buf[dsti],\
-               *(unsigned int*)&self->data[srci],\
-               *(unsigned int*)&self->mask[srci])\
+          unsigned int src32 = *(unsigned int*)&self->data[srci];\
+          func(*(unsigned int*)&buf[dsti], src32,\
+               derived ? DERIVE_MASK32(src32)\
+                       : *(unsigned int*)&self->mask[srci])\
           srci += 4;\
           dsti += 4;\
         }\
         for (; x < sw; x++) {\
-          func(buf[dsti], self->data[srci], self->mask[srci])\
+          func(buf[dsti], self->data[srci],\
+               derived ? DERIVE_MASK(self->data[srci]) : self->mask[srci])\
           srci++;\
           dsti++;\
         }\
@@ -166,16 +654,26 @@ void image_blit(image_t *self, pixel_t *buf, int bufw, int bufh,
       }\
     }
 
-  #define BLIT_LOOP_FLIPPED(func)\
+  #define BLIT_LOOP_FLIPPED(func, derived)\
     {\
       int x, y;\
-      int srci = sx + sy * self->width + sw - 1;\
+      int srci = sx + sy * self->stride + sw - 1;\
       int dsti = dx + dy * bufw;\
-      int srcrowdiff = self->width + sw;\
+      int srcrowdiff = self->stride + sw;\
       int dstrowdiff = bufw - sw;\
+      int sw32 = sw - (sw & 3);\
       for (y = 0; y < sh; y++) {\
-        for (x = 0; x < sw; x++) {\
-          func(buf[dsti], self->data[srci], self->mask[srci])\
+        for (x = 0; x < sw32; x += 4) {\
+          unsigned int src32 = BSWAP32(*(unsigned int*)&self->data[srci - 3]);\
+          func(*(unsigned int*)&buf[dsti], src32,\
+               derived ? DERIVE_MASK32(src32)\
+                       : BSWAP32(*(unsigned int*)&self->mask[srci - 3]))\
+          srci -= 4;\
+          dsti += 4;\
+        }\
+        for (; x < sw; x++) {\
+          func(buf[dsti], self->data[srci],\
+               derived ? DERIVE_MASK(self->data[srci]) : self->mask[srci])\
           srci--;\
           dsti++;\
         }\
@@ -184,50 +682,272 @@ void image_blit(image_t *self, pixel_t *buf, int bufw, int bufh,
       }\
     }
 
-  #define BLIT_NORMAL(dst, src, msk)\
-    (dst) &= (msk);\
-    (dst) |= (src);
-
-  #define BLIT_AND(dst, src, msk)\
-    (dst) &= (src);
-
-  #define BLIT_OR(dst, src, msk)\
-    (dst) |= (src);
-
-  #define BLIT_COLOR(dst, src, msk)\
-    (dst) &= (msk);\
-    (dst) |= ~(msk) & image_color;
-
-  #define BLIT(blit_loop)\
+  #define BLIT_MODES(blit_loop, derived)\
     switch (image_blendMode) {\
       default:\
-      case IMAGE_NORMAL : blit_loop(BLIT_NORMAL)  break;\
-      case IMAGE_AND    : blit_loop(BLIT_AND)     break;\
-      case IMAGE_OR     : blit_loop(BLIT_OR)      break;\
-      case IMAGE_COLOR  : blit_loop(BLIT_COLOR)   break;\
-    }\
+      case IMAGE_NORMAL : blit_loop(BLIT_NORMAL, derived)  break;\
+      case IMAGE_AND    : blit_loop(BLIT_AND, derived)     break;\
+      case IMAGE_OR     : blit_loop(BLIT_OR, derived)      break;\
+      case IMAGE_COLOR  : blit_loop(BLIT_COLOR, derived)   break;\
+    }
+
+  #define BLIT(blit_loop)\
+    if (self->mask) {\
+      BLIT_MODES(blit_loop, 0)\
+    } else {\
+      BLIT_MODES(blit_loop, 1)\
+    }
 
   if (!image_flip) {
     if (image_blendMode == IMAGE_FAST) {
       int y;
-      int srci = sx + sy * self->width;
+      int srci = sx + sy * self->stride;
       int dsti = dx + dy * bufw;
       for (y = 0; y < sh; y++) {
         memcpy(buf + dsti, self->data + srci, sw);
-        srci += self->width;
+        srci += self->stride;
         dsti += bufw;
       }
+    } else if ((unsigned) image_blendMode <= IMAGE_COLOR &&
+               blitRows[image_blendMode] && self->mask) {
+      blitKernel(blitRows[image_blendMode], self, buf, bufw,
+                 dx, dy, sx, sy, sw, sh);
     } else {
       BLIT(BLIT_LOOP_NORMAL);
     }
   } else {
-    BLIT(BLIT_LOOP_FLIPPED);
+    if (image_blendMode == IMAGE_FAST) {
+      BLIT_LOOP_FLIPPED(BLIT_FAST, 0);
+    } else {
+      BLIT(BLIT_LOOP_FLIPPED);
+    }
+  }
+
+}
+
+
+static int clipRange(int f, int df, int limit, int *a, int *b) {
+  /* Narrows the range of steps [a, b) to those where the fixed point value
+   * `f + step * df` lies within [0, limit). Returns 0 if the range is empty */
+  int lo = *a, hi = *b;
+  if (df == 0) {
+    return f >= 0 && f < limit && lo < hi;
+  }
+  /* Estimate the range, then correct the estimate for rounding */
+  double p = -(double) f / df;
+  double q = (double) (limit - f) / df;
+  if (p > q) { double tmp = p; p = q; q = tmp; }
+  if (p > lo) lo = (p > hi) ? hi : (int) p;
+  if (q < hi) hi = (q < lo) ? lo : (int) q + 1;
+  #define INSIDE(i) (f + (i) * df >= 0 && f + (i) * df < limit)
+  while (lo < hi && !INSIDE(lo)) lo++;
+  while (lo < hi && !INSIDE(hi - 1)) hi--;
+  #undef INSIDE
+  *a = lo;
+  *b = hi;
+  return lo < hi;
+}
+
+
+static void getTransformCorners(const image_transform_t *t, int w, int h,
+                                double *xs, double *ys
+) {
+  /* Gets the destination position of the 4 corners of a `w` x `h` rect */
+  double c = cos(t->angle), s = sin(t->angle);
+  int i;
+  for (i = 0; i < 4; i++) {
+    double X = t->sx * (((i & 1) ? w : 0) - t->ox);
+    double Y = t->sy * (((i & 2) ? h : 0) - t->oy);
+    xs[i] = t->x + c * X - s * Y;
+    ys[i] = t->y + s * X + c * Y;
   }
+}
+
 
+void image_getTransformBounds(const image_transform_t *t, int w, int h,
+                              int *x, int *y, int *bw, int *bh
+) {
+  /* Gets the rect of pixels which a `w` x `h` rect drawn with the transform
+   * could cover */
+  double xs[4], ys[4];
+  double x0, y0, x1, y1;
+  int i;
+  getTransformCorners(t, w, h, xs, ys);
+  x0 = x1 = xs[0];
+  y0 = y1 = ys[0];
+  for (i = 1; i < 4; i++) {
+    if (xs[i] < x0) x0 = xs[i];
+    if (xs[i] > x1) x1 = xs[i];
+    if (ys[i] < y0) y0 = ys[i];
+    if (ys[i] > y1) y1 = ys[i];
+  }
+  *x = floor(x0);
+  *y = floor(y0);
+  *bw = ceil(x1) - *x;
+  *bh = ceil(y1) - *y;
+}
+
+
+static void blitIntegerScaled(image_t *self, pixel_t *buf, int bufw, int bufh,
+                              int left, int top, int isx, int isy,
+                              int qx, int qy, int qw, int qh
+) {
+  /* Blits the source rect with each pixel drawn as an `isx` x `isy` block;
+   * a negative `isx` flips the rect horizontally */
+  int flip = isx < 0;
+  if (flip) isx = -isx;
+  int x0 = left, y0 = top;
+  int x1 = left + qw * isx, y1 = top + qh * isy;
+  image_rect_t c;
+  getClip(bufw, bufh, &c);
+  if (x0 < c.x0) x0 = c.x0;
+  if (y0 < c.y0) y0 = c.y0;
+  if (x1 > c.x1) x1 = c.x1;
+  if (y1 > c.y1) y1 = c.y1;
+  if (x0 >= x1 || y0 >= y1) return;
+  const pixel_t *remap = getRemap();
+  int step = flip ? -1 : 1;
+  int u0 = (x0 - left) / isx;
+  int rem0 = (x0 - left) % isx;
+  if (flip) u0 = qw - 1 - u0;
+
+  #define SCALED_LOOP(func)\
+    {\
+      int x, y;\
+      for (y = y0; y < y1; y++) {\
+        int srci = qx + u0 + (qy + (y - top) / isy) * self->stride;\
+        pixel_t *dst = buf + y * bufw;\
+        int rem = rem0;\
+        for (x = x0; x < x1; x++) {\
+          func(dst[x], remap[self->data[srci]], MASK_AT(self, srci))\
+          if (++rem == isx) {\
+            rem = 0;\
+            srci += step;\
+          }\
+        }\
+      }\
+    }
+
+  BLIT_PIXELS(SCALED_LOOP);
+}
+
+
+static void blitAffine(image_t *self, pixel_t *buf, int bufw, int bufh,
+                       const image_transform_t *t,
+                       int qx, int qy, int qw, int qh
+) {
+  /* Blits the source rect by inverse mapping each destination pixel's center
+   * into the source rect using 16.16 fixed point. The range of pixels inside
+   * the source rect is found for each row so the inner loops don't need any
+   * bounds checks */
+  int x0, y0, bw, bh;
+  image_getTransformBounds(t, qw, qh, &x0, &y0, &bw, &bh);
+  int x1 = x0 + bw, y1 = y0 + bh;
+  /* Rows are stepped from the unclipped left edge so that the pixels drawn
+   * don't depend on where the blit is clipped */
+  int left = x0;
+  image_rect_t clip;
+  getClip(bufw, bufh, &clip);
+  if (x0 < clip.x0) x0 = clip.x0;
+  if (y0 < clip.y0) y0 = clip.y0;
+  if (x1 > clip.x1) x1 = clip.x1;
+  if (y1 > clip.y1) y1 = clip.y1;
+  if (x0 >= x1 || y0 >= y1) return;
+
+  /* Get the source position's step per destination pixel */
+  double c = cos(t->angle), s = sin(t->angle);
+  double dudx = c / t->sx, dvdx = -s / t->sy;
+  double dudy = s / t->sx, dvdy = c / t->sy;
+  int fdudx = dudx * 65536., fdvdx = dvdx * 65536.;
+  int fw = qw << 16, fh = qh << 16;
+  int unrotated = (fdvdx == 0);
+  const pixel_t *remap = getRemap();
+
+  #define AFFINE_LOOP(func)\
+    {\
+      int y;\
+      for (y = y0; y < y1; y++) {\
+        /* Get source position of the row's first pixel center */\
+        double X = left + 0.5 - t->x;\
+        double Y = y + 0.5 - t->y;\
+        int fu = (X * dudx + Y * dudy + t->ox) * 65536.;\
+        int fv = (X * dvdx + Y * dvdy + t->oy) * 65536.;\
+        /* Get the range of pixels inside the source rect */\
+        int a = x0 - left, b = x1 - left;\
+        if (!clipRange(fu, fdudx, fw, &a, &b)) continue;\
+        if (!clipRange(fv, fdvdx, fh, &a, &b)) continue;\
+        fu += a * fdudx;\
+        fv += a * fdvdx;\
+        pixel_t *dst = buf + left + a + y * bufw;\
+        pixel_t *end = dst + (b - a);\
+        if (unrotated) {\
+          int rowi = qx + (qy + (fv >> 16)) * self->stride;\
+          for (; dst < end; dst++) {\
+            int i = rowi + (fu >> 16);\
+            func(*dst, remap[self->data[i]], MASK_AT(self, i))\
+            fu += fdudx;\
+          }\
+        } else {\
+          for (; dst < end; dst++) {\
+            int i = qx + (fu >> 16) + (qy + (fv >> 16)) * self->stride;\
+            func(*dst, remap[self->data[i]], MASK_AT(self, i))\
+            fu += fdudx;\
+            fv += fdvdx;\
+          }\
+        }\
+      }\
+    }
+
+  BLIT_PIXELS(AFFINE_LOOP);
+}
+
+
+void image_blitTransformed(image_t *self, pixel_t *buf, int bufw, int bufh,
+                           const image_transform_t *t,
+                           int qx, int qy, int qw, int qh
+) {
+  /* Clip the source rect to the image */
+  if (qx < 0) { qw += qx; qx = 0; }
+  if (qy < 0) { qh += qy; qy = 0; }
+  if (qx + qw > self->width) qw = self->width - qx;
+  if (qy + qh > self->height) qh = self->height - qy;
+  if (qw <= 0 || qh <= 0 || t->sx == 0 || t->sy == 0) return;
+
+  /* Get the blend mode's lookup table if it uses one */
+  getLookup();
+
+  /* Unrotated with integer scale: use image_blit() for a scale of 1 or -1,
+   * else the block scaling loop */
+  if (t->angle == 0 && t->sy > 0 &&
+      t->sx == (int) t->sx && t->sy == (int) t->sy
+  ) {
+    int isx = t->sx, isy = t->sy;
+    int left = ceil(t->x - (isx < 0 ? qw - t->ox : t->ox) * abs(isx) - 0.5);
+    int top = ceil(t->y - t->oy * isy - 0.5);
+    if (isy == 1 && (isx == 1 || isx == -1)) {
+      int oldFlip = image_flip;
+      image_flip = (isx < 0);
+      image_blit(self, buf, bufw, bufh, left, top, qx, qy, qw, qh);
+      image_flip = oldFlip;
+    } else {
+      blitIntegerScaled(self, buf, bufw, bufh, left, top, isx, isy,
+                        qx, qy, qw, qh);
+    }
+    return;
+  }
+
+  blitAffine(self, buf, bufw, bufh, t, qx, qy, qw, qh);
 }
 
 
 void image_deinit(image_t *self) {
-  dmt_free(self->data);
-  dmt_free(self->mask);
+  if (self->parent) {
+    /* Views don't own their pixels */
+  } else if (self->page) {
+    atlas_release(self->page);
+  } else {
+    dmt_free(self->data);
+    dmt_free(self->mask);
+  }
+  dmt_free(self->spans);
 }
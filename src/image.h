@@ -9,6 +9,7 @@
 #define IMAGE_H
 
 #include "vga.h"
+#include "atlas.h"
 #include "luaobj.h"
 
 
@@ -18,38 +19,88 @@ enum {
   IMAGE_AND,
   IMAGE_OR,
   IMAGE_COLOR,
+  IMAGE_TRANSLUCENT,
+  IMAGE_ADD,
+  IMAGE_DARKEN,
+  IMAGE_TINT,
 } IMAGE_BLEND_MODE;
 
 
 typedef struct {
+  int x0, y0, x1, y1;
+} image_rect_t;
+
+typedef struct {
+  double x, y, angle;
+  double sx, sy;
+  double ox, oy;
+} image_transform_t;
+
+typedef struct image_t image_t;
+
+struct image_t {
   pixel_t *data;
   pixel_t *mask;
+  int *spans;
   int width, height;
-} image_t;
+  int stride;
+  atlas_page_t *page;
+  image_t *parent;
+  int changes, parentChanges;
+};
+
+/* `stride` is the number of pixels between the start of each row of `data`
+ * and `mask`. If `page` is set the pixels are packed into an atlas page rather
+ * than being owned by the image. If `parent` is set the image is a view into
+ * a rect of the parent's pixels, which the parent owns. If `mask` is NULL then
+ * pixels of 0 are transparent and all others are opaque */
+
+/* `spans` is NULL or holds an offset per row followed by the row's run data;
+ * each row is a sequence of (transparent skip, opaque copy) length pairs which
+ * add up to the image's width. `changes` is incremented each time the spans
+ * are discarded; a view's spans are dropped if its parent's `changes` differs
+ * from the `parentChanges` they were built at */
+#define IMAGE_SPANROW(img, y)\
+  ((unsigned short*) ((img)->spans + (img)->height) + (img)->spans[y])
 
 
 static inline
 void image_setPixel(image_t* self, int x, int y, pixel_t val) {
   if (x >= 0 && x < self->width && y >= 0 && y < self->height) {
-    self->data[x + y * self->width] = val;
+    self->data[x + y * self->stride] = val;
   }
 }
 
 static inline
 void image_setMaskPixel(image_t* self, int x, int y, pixel_t val) {
-  if (x >= 0 && x < self->width && y >= 0 && y < self->height) {
-    self->mask[x + y * self->width] = val;
+  if (self->mask && x >= 0 && x < self->width && y >= 0 && y < self->height) {
+    self->mask[x + y * self->stride] = val;
   }
 }
 
 void image_setColor(pixel_t color);
 void image_setBlendMode(int mode);
 void image_setFlip(int mode);
+void image_setRemap(const pixel_t *remap);
+void image_setDerivedMasks(int enable);
+int image_getDerivedMasks(void);
+void image_setClip(const image_rect_t *rect);
+void image_getClip(image_rect_t *rect);
+void image_initKernels(void);
 
 const char *image_init(image_t *self, const char *filename);
 void image_initBlank(image_t*, int, int);
+void image_initView(image_t *self, image_t *parent,
+                    int x, int y, int width, int height);
+void image_initSpans(image_t *self);
+void image_discardSpans(image_t *self);
 void image_blit(image_t *self, pixel_t *buf, int bufw, int bufh,
                 int dx, int dy, int sx, int sy, int sw, int sh);
+void image_blitTransformed(image_t *self, pixel_t *buf, int bufw, int bufh,
+                           const image_transform_t *t,
+                           int qx, int qy, int qw, int qh);
+void image_getTransformBounds(const image_transform_t *t, int w, int h,
+                              int *x, int *y, int *bw, int *bh);
 void image_deinit(image_t*);
 
 #endif
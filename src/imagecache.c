@@ -0,0 +1,171 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lib/dmt/dmt.h"
+#include "filesystem.h"
+#include "palette.h"
+#include "imagecache.h"
+
+/* Decoded images are cached in the write directory as a file named after the
+ * hash of the image's filename. The file contains a header, the image's
+ * filename, the colors the image uses and a byte per pixel indexing those
+ * colors, 0 being transparent. The cache file is only used if the size and
+ * contents hash of the image file it was made from match */
+
+#define MAGIC   0x43494c44  /* "LDIC" */
+#define VERSION 1
+
+typedef struct {
+  unsigned magic, version;
+  unsigned size, hash;
+  unsigned width, height;
+  unsigned nameLength, colorCount;
+} header_t;
+
+int imagecache_enabled;
+
+
+void imagecache_setEnabled(int enable) {
+  imagecache_enabled = !!enable;
+}
+
+
+int imagecache_isEnabled(void) {
+  return imagecache_enabled;
+}
+
+
+static unsigned hash(const void *data, int size) {
+  /* FNV-1a */
+  unsigned h = 2166136261u;
+  const unsigned char *p = data;
+  while (size--) {
+    h = (h ^ *p++) * 16777619u;
+  }
+  return h;
+}
+
+
+static void getCacheFilename(char *dst, const char *filename) {
+  sprintf(dst, "%08x.imc", hash(filename, strlen(filename)));
+}
+
+
+pixel_t *imagecache_load(const char *filename, const void *filedata, int size,
+                         int *width, int *height) {
+  /* Returns the image's pixels, indexing the system palette, from the cache
+   * file, or NULL if there is no valid cache file for the image */
+  char cachename[16];
+  pixel_t *res = NULL;
+  header_t h;
+  int cachesize;
+  if (!imagecache_enabled) return NULL;
+  getCacheFilename(cachename, filename);
+  char *p = filesystem_read(cachename, &cachesize);
+  if (!p) return NULL;
+
+  /* Check the header matches the image file */
+  if (cachesize < (int) sizeof(h)) goto end;
+  memcpy(&h, p, sizeof(h));
+  int namelen = strlen(filename);
+  unsigned npixels = h.width * h.height;
+  if (h.magic != MAGIC || h.version != VERSION ||
+      h.size != (unsigned) size || h.nameLength != (unsigned) namelen ||
+      h.colorCount > 255 || h.width > 0xffff || h.height > 0xffff ||
+      (unsigned) cachesize !=
+        sizeof(h) + namelen + h.colorCount * sizeof(unsigned) + npixels ||
+      memcmp(p + sizeof(h), filename, namelen) != 0 ||
+      h.hash != hash(filedata, size)
+  ) {
+    goto end;
+  }
+
+  /* Add the image's colors to the palette */
+  unsigned *colors = (unsigned*) (p + sizeof(h) + namelen);
+  pixel_t map[256];
+  unsigned i;
+  memset(map, 0, sizeof(map));
+  for (i = 0; i < h.colorCount; i++) {
+    unsigned c = colors[i];
+    int idx = palette_colorToIdx(c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff);
+    if (idx < 0) goto end;
+    map[i + 1] = idx;
+  }
+
+  /* Map the pixels to the palette */
+  pixel_t *src = (pixel_t*) (colors + h.colorCount);
+  res = dmt_malloc(npixels);
+  for (i = 0; i < npixels; i++) {
+    res[i] = map[src[i]];
+  }
+  *width = h.width;
+  *height = h.height;
+
+end:
+  filesystem_free(p);
+  return res;
+}
+
+
+void imagecache_save(const char *filename, const void *filedata, int size,
+                     const pixel_t *data, int width, int height, int stride) {
+  /* Writes the cache file for the image; errors are ignored as the cache is
+   * only used to speed up loading */
+  char cachename[16];
+  pixel_t map[256];
+  unsigned colors[255];
+  header_t h;
+  int x, y;
+  if (!imagecache_enabled) return;
+
+  /* Get the colors the image uses */
+  memset(map, 0, sizeof(map));
+  h.colorCount = 0;
+  for (y = 0; y < height; y++) {
+    const pixel_t *row = data + y * stride;
+    for (x = 0; x < width; x++) {
+      int rgb[3];
+      if (row[x] == 0 || map[row[x]]) continue;
+      palette_idxToColor(row[x], rgb);
+      colors[h.colorCount] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
+      map[row[x]] = ++h.colorCount;
+    }
+  }
+
+  /* Build the file */
+  int namelen = strlen(filename);
+  h.magic = MAGIC;
+  h.version = VERSION;
+  h.size = size;
+  h.hash = hash(filedata, size);
+  h.width = width;
+  h.height = height;
+  h.nameLength = namelen;
+  int colorsize = h.colorCount * sizeof(unsigned);
+  int cachesize = sizeof(h) + namelen + colorsize + width * height;
+  char *p = dmt_malloc(cachesize);
+  char *dst = p;
+  memcpy(dst, &h, sizeof(h));
+  dst += sizeof(h);
+  memcpy(dst, filename, namelen);
+  dst += namelen;
+  memcpy(dst, colors, colorsize);
+  dst += colorsize;
+  for (y = 0; y < height; y++) {
+    const pixel_t *row = data + y * stride;
+    for (x = 0; x < width; x++) {
+      *dst++ = map[row[x]];
+    }
+  }
+
+  getCacheFilename(cachename, filename);
+  filesystem_write(cachename, p, cachesize);
+  dmt_free(p);
+}
@@ -0,0 +1,20 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include "vga.h"
+
+void imagecache_setEnabled(int enable);
+int imagecache_isEnabled(void);
+pixel_t *imagecache_load(const char *filename, const void *filedata, int size,
+                         int *width, int *height);
+void imagecache_save(const char *filename, const void *filedata, int size,
+                     const pixel_t *data, int width, int height, int stride);
+
+#endif
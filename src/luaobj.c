@@ -90,3 +90,13 @@ void *luaobj_checkudata(lua_State *L, int index, uint32_t type) {
   return udata + 1;
 }
 
+
+void *luaobj_testudata(lua_State *L, int index, uint32_t type) {
+  /* Same as luaobj_checkudata() but returns NULL instead of erroring out if
+   * the udata is not of the correct class */
+  luaobj_head_t *udata = lua_touserdata(L, index);
+  if (!udata || !(udata->type & type)) {
+    return NULL;
+  }
+  return udata + 1;
+}
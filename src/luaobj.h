@@ -26,6 +26,10 @@ typedef struct {
 #define LUAOBJ_TYPE_QUAD   (1 << 1)
 #define LUAOBJ_TYPE_FONT   (1 << 2)
 #define LUAOBJ_TYPE_SOURCE (1 << 3)
+#define LUAOBJ_TYPE_SPRITEBATCH (1 << 4)
+#define LUAOBJ_TYPE_TILEMAP (1 << 5)
+#define LUAOBJ_TYPE_REMAP  (1 << 6)
+#define LUAOBJ_TYPE_TEXT   (1 << 7)
 
 
 int luaobj_newclass(lua_State *L, const char *name, const char *extends,
@@ -33,6 +37,7 @@ int luaobj_newclass(lua_State *L, const char *name, const char *extends,
 void luaobj_setclass(lua_State *L, uint32_t type, char *name);
 void *luaobj_newudata(lua_State *L, int size);
 void *luaobj_checkudata(lua_State *L, int index, uint32_t type);
+void *luaobj_testudata(lua_State *L, int index, uint32_t type);
 
 
 #endif
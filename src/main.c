@@ -22,6 +22,7 @@
 #include "image.h"
 #include "palette.h"
 #include "package.h"
+#include "font.h"
 
 
 static lua_State *L;
@@ -56,11 +57,28 @@ int main(int argc, char **argv) {
     exit(EXIT_SUCCESS);
   }
 
+  /* Handle bake font command */
+  if ( argc > 1 && strcmp(argv[1], "--bake-font") == 0 ) {
+    if (argc < 5) {
+      printf("expected arguments: %s FONTFILE PTSIZE OUTFILE [CHARS]\n",
+             argv[1]);
+      exit(EXIT_FAILURE);
+    }
+    const char *err = font_bake(argv[2], atoi(argv[3]),
+                                argc > 5 ? argv[5] : NULL, argv[4]);
+    if (err) {
+      printf("Bake font error: %s\n", err);
+      exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+  }
+
   /* Init everything */
   atexit(deinit);
   audio_init();
   vga_init();
   palette_init();
+  image_initKernels();
   keyboard_init();
   mouse_init();
 
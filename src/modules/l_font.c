@@ -15,7 +15,7 @@
 int l_font_new(lua_State *L) {
   const char *filename;
   int ptsize = 8;
-  if ( lua_isnoneornil(L, 2) ) {
+  if ( lua_isnoneornil(L, 2) && lua_type(L, 1) != LUA_TSTRING ) {
     filename = NULL;
     ptsize = luaL_optnumber(L, 1, ptsize);
   } else {
@@ -34,6 +34,18 @@ int l_font_new(lua_State *L) {
 }
 
 
+int l_font_newImage(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  const char *glyphs = luaL_checkstring(L, 2);
+  int spacing = luaL_optnumber(L, 3, 0);
+  font_t *self = luaobj_newudata(L, sizeof(*self));
+  luaobj_setclass(L, CLASS_TYPE, CLASS_NAME);
+  const char *err = font_initImage(self, filename, glyphs, spacing);
+  if (err) luaL_error(L, err);
+  return 1;
+}
+
+
 int l_font_gc(lua_State *L) {
   font_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
   font_deinit(self);
@@ -42,14 +54,31 @@ int l_font_gc(lua_State *L) {
 
 
 int l_font_getWidth(lua_State *L) {
+  font_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  const char *str = luaL_checkstring(L, 2);
+  lua_pushinteger(L, font_getWidth(self, str));
+  return 1;
+}
+
+
+int l_font_getWrap(lua_State *L) {
   font_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
   const char *p = luaL_checkstring(L, 2);
-  int width = 0;
-  while (*p) {
-    width += self->glyphs[(int) (*p++ & 127)].xadvance;
+  int limit = luaL_checknumber(L, 3);
+  int maxWidth = 0, n = 0;
+  lua_newtable(L);
+  while (p) {
+    const char *end;
+    int width;
+    const char *next = font_wrapLine(self, p, limit, &end, &width);
+    if (width > maxWidth) maxWidth = width;
+    lua_pushlstring(L, p, end - p);
+    lua_rawseti(L, -2, ++n);
+    p = next;
   }
-  lua_pushinteger(L, width);
-  return 1;
+  lua_pushinteger(L, maxWidth);
+  lua_insert(L, -2);
+  return 2;
 }
 
 
@@ -66,6 +95,7 @@ int luaopen_font(lua_State *L) {
     { "new",            l_font_new            },
     { "__gc",           l_font_gc             },
     { "getWidth",       l_font_getWidth       },
+    { "getWrap",        l_font_getWrap        },
     { "getHeight",      l_font_getHeight      },
     { 0, 0 },
   };
@@ -7,12 +7,22 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 #include <pc.h>
 #include "palette.h"
 #include "image.h"
 #include "font.h"
 #include "quad.h"
+#include "spritebatch.h"
+#include "tilemap.h"
+#include "remap.h"
+#include "text.h"
 #include "vga.h"
+#include "dirty.h"
+#include "atlas.h"
+#include "imagecache.h"
+#include "quantize.h"
+#include "frame.h"
 #include "luaobj.h"
 
 image_t  *graphics_screen;
@@ -25,6 +35,18 @@ int       graphics_backgroundColor_rgb[3];
 pixel_t   graphics_color;
 int       graphics_color_rgb[3];
 int       graphics_blendMode;
+int       graphics_lineWidth;
+
+#define GRAPHICS_STACK_MAX 16
+
+typedef struct {
+  int enabled;
+  image_rect_t rect;
+} scissor_t;
+
+scissor_t graphics_scissor;
+scissor_t graphics_stack[GRAPHICS_STACK_MAX];
+int       graphics_stackIdx;
 
 
 static int getColorFromArgs(lua_State *L, int *rgb, const int *def) {
@@ -38,7 +60,7 @@ static int getColorFromArgs(lua_State *L, int *rgb, const int *def) {
     g = luaL_checknumber(L, 2);
     b = luaL_checknumber(L, 3);
   }
-  int idx = palette_colorToIdx(r, g, b);
+  int idx = palette_matchIdx(r, g, b);
   if (idx < 0) {
     luaL_error(L, "color palette exhausted: use fewer unique colors");
   }
@@ -51,6 +73,80 @@ static int getColorFromArgs(lua_State *L, int *rgb, const int *def) {
 }
 
 
+static void getClip(image_rect_t *r) {
+  /* Gets the intersection of the canvas bounds and the scissor rect */
+  r->x0 = 0;
+  r->y0 = 0;
+  r->x1 = graphics_canvas->width;
+  r->y1 = graphics_canvas->height;
+  if (graphics_scissor.enabled) {
+    image_rect_t *s = &graphics_scissor.rect;
+    if (s->x0 > r->x0) r->x0 = s->x0;
+    if (s->y0 > r->y0) r->y0 = s->y0;
+    if (s->x1 < r->x1) r->x1 = s->x1;
+    if (s->y1 < r->y1) r->y1 = s->y1;
+  }
+}
+
+
+static void updateClip(void) {
+  /* Blits are given the canvas' stride as the buffer width so the clip rect
+   * always includes the canvas bounds */
+  image_rect_t c;
+  getClip(&c);
+  image_setClip(&c);
+}
+
+
+static void setScissor(int enabled, int x, int y, int w, int h) {
+  graphics_scissor.enabled = enabled;
+  if (enabled) {
+    graphics_scissor.rect.x0 = x;
+    graphics_scissor.rect.y0 = y;
+    graphics_scissor.rect.x1 = x + (w > 0 ? w : 0);
+    graphics_scissor.rect.y1 = y + (h > 0 ? h : 0);
+  }
+  updateClip();
+}
+
+
+static inline void clipPixel(const image_rect_t *c, int x, int y) {
+  if (x < c->x0 || x >= c->x1 || y < c->y0 || y >= c->y1) return;
+  graphics_canvas->data[x + y * graphics_canvas->stride] = graphics_color;
+}
+
+
+static void fillRow(const image_rect_t *c, int x0, int x1, int y) {
+  /* Fills the pixels [x0, x1) of the row `y`, clipped to the rect */
+  if (y < c->y0 || y >= c->y1) return;
+  if (x0 < c->x0) x0 = c->x0;
+  if (x1 > c->x1) x1 = c->x1;
+  if (x0 >= x1) return;
+  memset(graphics_canvas->data + x0 + y * graphics_canvas->stride,
+         graphics_color, x1 - x0);
+}
+
+
+static void markDirty(int x, int y, int w, int h) {
+  /* Records the area as drawn to if we're tracking the screen's dirty
+   * regions */
+  if (dirty_isEnabled() && graphics_canvas == graphics_screen) {
+    if (graphics_scissor.enabled) {
+      image_rect_t *s = &graphics_scissor.rect;
+      int x1 = x + w, y1 = y + h;
+      if (x < s->x0) x = s->x0;
+      if (y < s->y0) y = s->y0;
+      if (x1 > s->x1) x1 = s->x1;
+      if (y1 > s->y1) y1 = s->y1;
+      w = x1 - x;
+      h = y1 - y;
+      if (w <= 0 || h <= 0) return;
+    }
+    dirty_add(x, y, w, h);
+  }
+}
+
+
 static int pushColor(lua_State *L, int *rgb) {
   lua_pushinteger(L, rgb[0]);
   lua_pushinteger(L, rgb[1]);
@@ -112,6 +208,10 @@ int l_graphics_getBlendMode(lua_State *L) {
     case IMAGE_AND    : lua_pushstring(L, "and");     break;
     case IMAGE_OR     : lua_pushstring(L, "or");      break;
     case IMAGE_COLOR  : lua_pushstring(L, "color");   break;
+    case IMAGE_TRANSLUCENT : lua_pushstring(L, "translucent"); break;
+    case IMAGE_ADD    : lua_pushstring(L, "add");     break;
+    case IMAGE_DARKEN : lua_pushstring(L, "darken");  break;
+    case IMAGE_TINT   : lua_pushstring(L, "tint");    break;
   }
   return 1;
 }
@@ -119,9 +219,9 @@ int l_graphics_getBlendMode(lua_State *L) {
 
 int l_graphics_setBlendMode(lua_State *L) {
   const char *str = lua_isnoneornil(L, 1) ? "normal" : luaL_checkstring(L, 1);
-  #define SET_BLEND_MODE(str, e)\
+  #define SET_BLEND_MODE(name, e)\
     do {\
-      if (!strcmp(str, str)) {\
+      if (!strcmp(str, name)) {\
         graphics_blendMode = e;\
         image_setBlendMode(graphics_blendMode);\
         return 0;\
@@ -131,9 +231,13 @@ int l_graphics_setBlendMode(lua_State *L) {
   switch (*str) {
     case 'n'  : SET_BLEND_MODE("normal",  IMAGE_NORMAL);  break;
     case 'f'  : SET_BLEND_MODE("fast",    IMAGE_FAST);    break;
-    case 'a'  : SET_BLEND_MODE("and",     IMAGE_AND);     break;
+    case 'a'  : SET_BLEND_MODE("and",     IMAGE_AND);
+                SET_BLEND_MODE("add",     IMAGE_ADD);     break;
     case 'o'  : SET_BLEND_MODE("or",      IMAGE_OR);      break;
     case 'c'  : SET_BLEND_MODE("color",   IMAGE_COLOR);   break;
+    case 't'  : SET_BLEND_MODE("translucent", IMAGE_TRANSLUCENT);
+                SET_BLEND_MODE("tint",    IMAGE_TINT);    break;
+    case 'd'  : SET_BLEND_MODE("darken",  IMAGE_DARKEN);  break;
   }
   #undef SET_BLEND_MODE
   luaL_argerror(L, 1, "bad blend mode");
@@ -141,6 +245,20 @@ int l_graphics_setBlendMode(lua_State *L) {
 }
 
 
+int l_graphics_getLineWidth(lua_State *L) {
+  lua_pushinteger(L, graphics_lineWidth);
+  return 1;
+}
+
+
+int l_graphics_setLineWidth(lua_State *L) {
+  int width = luaL_optnumber(L, 1, 1);
+  if (width <= 0) luaL_argerror(L, 1, "width must be larger than 0");
+  graphics_lineWidth = width;
+  return 0;
+}
+
+
 int l_graphics_getFont(lua_State *L) {
   lua_pushlightuserdata(L, graphics_font);
   lua_gettable(L, LUA_REGISTRYINDEX);
@@ -190,6 +308,8 @@ int l_graphics_setCanvas(lua_State *L) {
     lua_insert(L, 1);
   }
   graphics_canvas = luaobj_checkudata(L, 1, LUAOBJ_TYPE_IMAGE);
+  /* Drawing to the canvas would leave its span encoding out of date */
+  image_discardSpans(graphics_canvas);
   /* Remove old canvas from registry. This is done after we know the args are
    * okay so that the canvas remains unchanged if an error occurs */
   if (oldCanvas) {
@@ -201,6 +321,71 @@ int l_graphics_setCanvas(lua_State *L) {
   lua_pushlightuserdata(L, graphics_canvas);
   lua_pushvalue(L, 1);
   lua_settable(L, LUA_REGISTRYINDEX);
+  updateClip();
+  return 0;
+}
+
+
+int l_graphics_getScissor(lua_State *L) {
+  if (!graphics_scissor.enabled) {
+    lua_pushnil(L);
+    return 1;
+  }
+  image_rect_t *r = &graphics_scissor.rect;
+  lua_pushinteger(L, r->x0);
+  lua_pushinteger(L, r->y0);
+  lua_pushinteger(L, r->x1 - r->x0);
+  lua_pushinteger(L, r->y1 - r->y0);
+  return 4;
+}
+
+
+int l_graphics_setScissor(lua_State *L) {
+  if (lua_isnoneornil(L, 1)) {
+    setScissor(0, 0, 0, 0, 0);
+    return 0;
+  }
+  int x = luaL_checknumber(L, 1);
+  int y = luaL_checknumber(L, 2);
+  int w = luaL_checknumber(L, 3);
+  int h = luaL_checknumber(L, 4);
+  setScissor(1, x, y, w, h);
+  return 0;
+}
+
+
+int l_graphics_intersectScissor(lua_State *L) {
+  int x = luaL_checknumber(L, 1);
+  int y = luaL_checknumber(L, 2);
+  int x1 = luaL_checknumber(L, 3) + x;
+  int y1 = luaL_checknumber(L, 4) + y;
+  if (graphics_scissor.enabled) {
+    image_rect_t *r = &graphics_scissor.rect;
+    if (r->x0 > x) x = r->x0;
+    if (r->y0 > y) y = r->y0;
+    if (r->x1 < x1) x1 = r->x1;
+    if (r->y1 < y1) y1 = r->y1;
+  }
+  setScissor(1, x, y, x1 - x, y1 - y);
+  return 0;
+}
+
+
+int l_graphics_push(lua_State *L) {
+  if (graphics_stackIdx >= GRAPHICS_STACK_MAX) {
+    luaL_error(L, "maximum stack depth reached (more pushes than pops?)");
+  }
+  graphics_stack[graphics_stackIdx++] = graphics_scissor;
+  return 0;
+}
+
+
+int l_graphics_pop(lua_State *L) {
+  if (graphics_stackIdx <= 0) {
+    luaL_error(L, "minimum stack depth reached (more pops than pushes?)");
+  }
+  graphics_scissor = graphics_stack[--graphics_stackIdx];
+  updateClip();
   return 0;
 }
 
@@ -210,8 +395,10 @@ int l_graphics_reset(lua_State *L) {
     l_graphics_setBackgroundColor,
     l_graphics_setColor,
     l_graphics_setBlendMode,
+    l_graphics_setLineWidth,
     l_graphics_setFont,
     l_graphics_setCanvas,
+    l_graphics_setScissor,
     NULL,
   };
   int i;
@@ -225,6 +412,26 @@ int l_graphics_reset(lua_State *L) {
 
 int l_graphics_clear(lua_State *L) {
   int idx = getColorFromArgs(L, NULL, graphics_backgroundColor_rgb);
+  if (graphics_scissor.enabled ||
+      graphics_canvas->stride != graphics_canvas->width
+  ) {
+    /* Clear a row at a time, only clearing the area inside the scissor rect */
+    image_rect_t c;
+    getClip(&c);
+    int y;
+    for (y = c.y0; y < c.y1; y++) {
+      memset(graphics_canvas->data + c.x0 + y * graphics_canvas->stride,
+             idx, c.x1 - c.x0);
+    }
+    if (c.x0 < c.x1) {
+      markDirty(c.x0, c.y0, c.x1 - c.x0, c.y1 - c.y0);
+    }
+    return 0;
+  }
+  if (dirty_isEnabled() && graphics_canvas == graphics_screen) {
+    dirty_clear(graphics_canvas->data, idx);
+    return 0;
+  }
   int sz = graphics_canvas->width * graphics_canvas->height;
   memset(graphics_canvas->data, idx, sz);
   return 0;
@@ -232,36 +439,313 @@ int l_graphics_clear(lua_State *L) {
 
 
 int l_graphics_present(lua_State *L) {
-  vga_update(graphics_screen->data);
+  frame_wait();
+  palette_present();
+  if (dirty_isEnabled()) {
+    dirty_present(graphics_screen->data);
+  } else {
+    vga_update(graphics_screen->data);
+  }
+  return 0;
+}
+
+
+int l_graphics_setVSync(lua_State *L) {
+  int mode = FRAME_VSYNC_OFF;
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    const char *str = lua_tostring(L, 1);
+    if (strcmp(str, "simulated")) {
+      luaL_argerror(L, 1, "bad vsync mode");
+    }
+    mode = FRAME_VSYNC_SIMULATED;
+  } else if (lua_toboolean(L, 1)) {
+    mode = FRAME_VSYNC_ON;
+  }
+  frame_setVSync(mode);
+  return 0;
+}
+
+
+int l_graphics_getVSync(lua_State *L) {
+  switch (frame_getVSync()) {
+    case FRAME_VSYNC_ON         : lua_pushboolean(L, 1);         break;
+    case FRAME_VSYNC_SIMULATED  : lua_pushstring(L, "simulated"); break;
+    default                     : lua_pushboolean(L, 0);         break;
+  }
+  return 1;
+}
+
+
+int l_graphics_setDirtyTracking(lua_State *L) {
+  dirty_setEnabled(lua_toboolean(L, 1));
+  return 0;
+}
+
+
+int l_graphics_isDirtyTracking(lua_State *L) {
+  lua_pushboolean(L, dirty_isEnabled());
+  return 1;
+}
+
+
+int l_graphics_setAtlasing(lua_State *L) {
+  atlas_setEnabled(lua_toboolean(L, 1));
+  return 0;
+}
+
+
+int l_graphics_isAtlasing(lua_State *L) {
+  lua_pushboolean(L, atlas_isEnabled());
+  return 1;
+}
+
+
+int l_graphics_setCompactImages(lua_State *L) {
+  image_setDerivedMasks(lua_toboolean(L, 1));
+  return 0;
+}
+
+
+int l_graphics_isCompactImages(lua_State *L) {
+  lua_pushboolean(L, image_getDerivedMasks());
+  return 1;
+}
+
+
+int l_graphics_setImageCaching(lua_State *L) {
+  imagecache_setEnabled(lua_toboolean(L, 1));
+  return 0;
+}
+
+
+int l_graphics_isImageCaching(lua_State *L) {
+  lua_pushboolean(L, imagecache_isEnabled());
+  return 1;
+}
+
+
+int l_graphics_setQuantizing(lua_State *L) {
+  quantize_setEnabled(lua_toboolean(L, 1), lua_toboolean(L, 2));
+  return 0;
+}
+
+
+int l_graphics_isQuantizing(lua_State *L) {
+  lua_pushboolean(L, quantize_isEnabled());
+  lua_pushboolean(L, quantize_isDithering());
+  return 2;
+}
+
+
+int l_graphics_quantize(lua_State *L) {
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int colors = luaL_optnumber(L, 2, 255);
+  n = lua_rawlen(L, 1);
+  /* Check the filenames first so an error can't leave a partly built
+   * histogram behind for the next call */
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (!lua_isstring(L, -1)) {
+      luaL_argerror(L, 1, "expected a table of filenames");
+    }
+    lua_pop(L, 1);
+  }
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    const char *filename = lua_tostring(L, -1);
+    const char *err = quantize_addImage(filename);
+    if (err) {
+      quantize_build(0);
+      luaL_error(L, "%s: %s", filename, err);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, quantize_build(colors));
+  return 1;
+}
+
+
+int l_graphics_setNearestColors(lua_State *L) {
+  palette_setNearestMode(lua_toboolean(L, 1));
+  return 0;
+}
+
+
+int l_graphics_isNearestColors(lua_State *L) {
+  lua_pushboolean(L, palette_getNearestMode());
+  return 1;
+}
+
+
+int l_graphics_getPaletteIndex(lua_State *L) {
+  int idx = getColorFromArgs(L, NULL, graphics_color_rgb);
+  lua_pushinteger(L, idx);
+  return 1;
+}
+
+
+int l_graphics_getPaletteColor(lua_State *L) {
+  int idx = luaL_checknumber(L, 1);
+  int rgb[3];
+  if (!palette_isUsed(idx)) {
+    return 0;
+  }
+  palette_idxToColor(idx, rgb);
+  lua_pushinteger(L, rgb[0]);
+  lua_pushinteger(L, rgb[1]);
+  lua_pushinteger(L, rgb[2]);
+  return 3;
+}
+
+
+int l_graphics_setPaletteColor(lua_State *L) {
+  int idx = luaL_checknumber(L, 1);
+  int r = luaL_checknumber(L, 2);
+  int g = luaL_checknumber(L, 3);
+  int b = luaL_checknumber(L, 4);
+  if (palette_setColor(idx, r, g, b)) {
+    luaL_error(L, "palette index %d is not in use", idx);
+  }
+  return 0;
+}
+
+
+int l_graphics_rotatePalette(lua_State *L) {
+  int first = luaL_checknumber(L, 1);
+  int last = luaL_checknumber(L, 2);
+  int steps = luaL_optnumber(L, 3, 1);
+  if (palette_rotate(first, last, steps)) {
+    luaL_error(L, "palette range %d-%d is not in use", first, last);
+  }
+  return 0;
+}
+
+
+int l_graphics_fadePalette(lua_State *L) {
+  int r = luaL_checknumber(L, 1);
+  int g = luaL_checknumber(L, 2);
+  int b = luaL_checknumber(L, 3);
+  double amount = luaL_checknumber(L, 4);
+  palette_setFade(r, g, b, amount * 256 + 0.5);
+  return 0;
+}
+
+
+static int drawSpriteBatch(lua_State *L, spritebatch_t *batch,
+                           const pixel_t *remap
+) {
+  int x = luaL_optnumber(L, 2, 0);
+  int y = luaL_optnumber(L, 3, 0);
+  image_setRemap(remap);
+  spritebatch_draw(batch, graphics_canvas->data, graphics_canvas->stride,
+                   graphics_canvas->height, x, y);
+  image_setRemap(NULL);
+  if (dirty_isEnabled()) {
+    int i;
+    for (i = 0; i < batch->count; i++) {
+      spritebatch_sprite_t *s = &batch->sprites[i];
+      markDirty(x + s->x, y + s->y, s->qw, s->qh);
+    }
+  }
+  return 0;
+}
+
+
+static int drawText(lua_State *L, text_t *text, const pixel_t *remap) {
+  int x = luaL_optnumber(L, 2, 0);
+  int y = luaL_optnumber(L, 3, 0);
+  image_setRemap(remap);
+  text_draw(text, graphics_canvas->data, graphics_canvas->stride,
+            graphics_canvas->height, x, y);
+  image_setRemap(NULL);
+  markDirty(x + text->x0, y + text->y0,
+            text->x1 - text->x0, text->y1 - text->y0);
+  return 0;
+}
+
+
+static int drawTileMap(lua_State *L, tilemap_t *map, const pixel_t *remap) {
+  int x = luaL_optnumber(L, 2, 0);
+  int y = luaL_optnumber(L, 3, 0);
+  image_setRemap(remap);
+  tilemap_draw(map, graphics_canvas->data, graphics_canvas->stride,
+               graphics_canvas->height, x, y);
+  image_setRemap(NULL);
+  markDirty(x, y, map->width * map->tileWidth, map->height * map->tileHeight);
   return 0;
 }
 
 
 int l_graphics_draw(lua_State *L) {
+  /* If the last argument is a Remap it is removed and used for the draw. The
+   * remap is only set around the blits as the other functions can error */
+  const pixel_t *remap = NULL;
+  int top = lua_gettop(L);
+  remap_t *r = top > 1 ? luaobj_testudata(L, top, LUAOBJ_TYPE_REMAP) : NULL;
+  if (r) {
+    remap = r->map;
+    lua_pop(L, 1);
+  }
+  spritebatch_t *batch = luaobj_testudata(L, 1, LUAOBJ_TYPE_SPRITEBATCH);
+  if (batch) {
+    return drawSpriteBatch(L, batch, remap);
+  }
+  tilemap_t *map = luaobj_testudata(L, 1, LUAOBJ_TYPE_TILEMAP);
+  if (map) {
+    return drawTileMap(L, map, remap);
+  }
+  text_t *text = luaobj_testudata(L, 1, LUAOBJ_TYPE_TEXT);
+  if (text) {
+    return drawText(L, text, remap);
+  }
   image_t *img = luaobj_checkudata(L, 1, LUAOBJ_TYPE_IMAGE);
   quad_t *quad = NULL;
-  int x, y, flip;
+  int idx = 2;
   if (!lua_isnone(L, 2) && lua_type(L, 2) != LUA_TNUMBER) {
     quad = luaobj_checkudata(L, 2, LUAOBJ_TYPE_QUAD);
-    x = luaL_optnumber(L, 3, 0);
-    y = luaL_optnumber(L, 4, 0);
-    flip = !lua_isnone(L, 5) && lua_toboolean(L, 5);
-  } else {
-    x = luaL_optnumber(L, 2, 0);
-    y = luaL_optnumber(L, 3, 0);
-    flip = !lua_isnone(L, 4) && lua_toboolean(L, 4);
+    idx = 3;
+  }
+  int qx = 0, qy = 0, qw = img->width, qh = img->height;
+  if (quad) {
+    qx = quad->x;
+    qy = quad->y;
+    qw = quad->width;
+    qh = quad->height;
   }
   pixel_t *buf = graphics_canvas->data;
-  int bufw = graphics_canvas->width;
+  int bufw = graphics_canvas->stride;
   int bufh = graphics_canvas->height;
-  image_setFlip(flip);
-  if (quad) {
-    image_blit(img, buf, bufw, bufh, x, y,
-               quad->x, quad->y, quad->width, quad->height);
-  } else {
-    image_blit(img, buf, bufw, bufh, x, y,
-               0, 0, img->width, img->height);
+  /* A number after the position means the transform arguments
+   * `r, sx, sy, ox, oy` are used rather than the `flip` argument */
+  if (lua_type(L, idx + 2) == LUA_TNUMBER) {
+    image_transform_t t;
+    t.x = luaL_optnumber(L, idx, 0);
+    t.y = luaL_optnumber(L, idx + 1, 0);
+    t.angle = luaL_checknumber(L, idx + 2);
+    t.sx = luaL_optnumber(L, idx + 3, 1);
+    t.sy = luaL_optnumber(L, idx + 4, t.sx);
+    t.ox = luaL_optnumber(L, idx + 5, 0);
+    t.oy = luaL_optnumber(L, idx + 6, 0);
+    image_setFlip(0);
+    image_setRemap(remap);
+    image_blitTransformed(img, buf, bufw, bufh, &t, qx, qy, qw, qh);
+    image_setRemap(NULL);
+    if (dirty_isEnabled()) {
+      int bx, by, bw, bh;
+      image_getTransformBounds(&t, qw, qh, &bx, &by, &bw, &bh);
+      markDirty(bx, by, bw, bh);
+    }
+    return 0;
   }
+  int x = luaL_optnumber(L, idx, 0);
+  int y = luaL_optnumber(L, idx + 1, 0);
+  int flip = !lua_isnone(L, idx + 2) && lua_toboolean(L, idx + 2);
+  image_setFlip(flip);
+  image_setRemap(remap);
+  image_blit(img, buf, bufw, bufh, x, y, qx, qy, qw, qh);
+  image_setRemap(NULL);
+  markDirty(x, y, qw, qh);
   return 0;
 }
 
@@ -269,16 +753,274 @@ int l_graphics_draw(lua_State *L) {
 int l_graphics_point(lua_State *L) {
   int x = luaL_checknumber(L, 1);
   int y = luaL_checknumber(L, 2);
-  image_setPixel(graphics_canvas, x, y, graphics_color);
+  image_rect_t c;
+  getClip(&c);
+  clipPixel(&c, x, y);
+  markDirty(x, y, 1, 1);
   return 0;
 }
 
 
+typedef struct {
+  int y0, y1;
+  double ax, ay, dx, x;
+} edge_t;
+
+/* An edge covers the rows [y0, y1) and starts at `ax`, `ay`, moving `dx` along
+ * x per row. `x` is where it crosses the center of the current row; this is
+ * worked out from the start each row so edges shared by polygons always cover
+ * the same pixels */
+
+
+static int compareEdges(const void *a, const void *b) {
+  return ((const edge_t*) a)->y0 - ((const edge_t*) b)->y0;
+}
+
+
+static int clampRow(const image_rect_t *c, double y) {
+  /* Returns the first row whose center is at or below `y`, clamped to the
+   * rect's rows */
+  if (y < c->y0) return c->y0;
+  if (y > c->y1) return c->y1;
+  return ceil(y - 0.5);
+}
+
+
+static int clampColumn(const image_rect_t *c, double x) {
+  if (x < c->x0) return c->x0;
+  if (x > c->x1) return c->x1;
+  return ceil(x - 0.5);
+}
+
+
+static int initEdges(const image_rect_t *c, edge_t *edges,
+                     const double *pts, int n
+) {
+  /* Inits an edge for each side of the polygon of `n` points which crosses a
+   * row center inside the rect, sorted by their first row. Returns the number
+   * of edges */
+  int i, count = 0;
+  for (i = 0; i < n; i++) {
+    const double *a = pts + i * 2;
+    const double *b = pts + ((i + 1) % n) * 2;
+    if (a[1] == b[1]) continue;
+    if (a[1] > b[1]) {
+      const double *t = a; a = b; b = t;
+    }
+    edge_t *e = &edges[count];
+    e->y0 = clampRow(c, a[1]);
+    e->y1 = clampRow(c, b[1]);
+    if (e->y0 >= e->y1) continue;
+    e->ax = a[0];
+    e->ay = a[1];
+    e->dx = (b[0] - a[0]) / (b[1] - a[1]);
+    count++;
+  }
+  qsort(edges, count, sizeof(*edges), compareEdges);
+  return count;
+}
+
+
+static void fillEdges(const image_rect_t *c, edge_t *edges, edge_t **active,
+                      int count
+) {
+  /* Fills the polygon described by the edges a row at a time using the
+   * even-odd rule; pixels are filled if their centers are inside. `active`
+   * must have room for `count` pointers */
+  int i, j, n = 0, next = 0;
+  int y = count > 0 ? edges[0].y0 : 0;
+  while (next < count || n > 0) {
+    /* Add the edges starting on this row and sort the active edges by where
+     * they cross the row */
+    while (next < count && edges[next].y0 == y) {
+      active[n++] = &edges[next++];
+    }
+    for (i = 0; i < n; i++) {
+      edge_t *e = active[i];
+      e->x = e->ax + (y + 0.5 - e->ay) * e->dx;
+    }
+    for (i = 1; i < n; i++) {
+      edge_t *e = active[i];
+      for (j = i; j > 0 && active[j - 1]->x > e->x; j--) {
+        active[j] = active[j - 1];
+      }
+      active[j] = e;
+    }
+    /* Fill between each pair of edges */
+    for (i = 0; i + 1 < n; i += 2) {
+      fillRow(c, clampColumn(c, active[i]->x),
+              clampColumn(c, active[i + 1]->x), y);
+    }
+    /* Step to the next row, dropping edges which have ended */
+    y++;
+    for (i = j = 0; i < n; i++) {
+      if (active[i]->y1 > y) active[j++] = active[i];
+    }
+    n = j;
+  }
+}
+
+
+static void markPointsDirty(const double *pts, int n) {
+  int i;
+  double x0 = pts[0], y0 = pts[1], x1 = pts[0], y1 = pts[1];
+  for (i = 1; i < n; i++) {
+    double x = pts[i * 2], y = pts[i * 2 + 1];
+    if (x < x0) x0 = x;
+    if (y < y0) y0 = y;
+    if (x > x1) x1 = x;
+    if (y > y1) y1 = y;
+  }
+  /* Clamp to a range which can't overflow but still covers any canvas */
+  #define CLAMP(v) ((v) < -0x8000 ? -0x8000 : (v) > 0x8000 ? 0x8000 : (v))
+  x0 = floor(CLAMP(x0));
+  y0 = floor(CLAMP(y0));
+  x1 = ceil(CLAMP(x1));
+  y1 = ceil(CLAMP(y1));
+  #undef CLAMP
+  markDirty(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+
+static double *checkPoints(lua_State *L, int idx, int *n) {
+  /* Gets the x, y pairs from the table at the stack index or from the
+   * arguments from the index onwards. The array is pushed to the stack as a
+   * userdata so that it is freed by the GC if an error occurs */
+  int i, count;
+  int table = lua_istable(L, idx);
+  if (table) {
+    count = lua_rawlen(L, idx);
+  } else {
+    count = lua_gettop(L) - idx + 1;
+  }
+  if (count % 2 != 0) {
+    luaL_error(L, "number of vertex components must be a multiple of two");
+  }
+  double *pts = lua_newuserdata(L, (count ? count : 1) * sizeof(*pts));
+  for (i = 0; i < count; i++) {
+    if (table) {
+      lua_rawgeti(L, idx, i + 1);
+      pts[i] = luaL_checknumber(L, -1);
+      lua_pop(L, 1);
+    } else {
+      pts[i] = luaL_checknumber(L, idx + i);
+    }
+  }
+  *n = count / 2;
+  return pts;
+}
+
+
+static void drawThickLine(const image_rect_t *c,
+                          int x0, int y0, int x1, int y1
+) {
+  /* Fills a rectangle of the line width along the line between the pixels'
+   * centers, extended by half the line width at each end so the segments of
+   * a polyline join up */
+  double hw = graphics_lineWidth / 2.0;
+  double dx = x1 - x0, dy = y1 - y0;
+  double len = sqrt(dx * dx + dy * dy);
+  double ux = len > 0 ? dx / len * hw : hw;
+  double uy = len > 0 ? dy / len * hw : 0;
+  double ax = x0 + 0.5 - ux, ay = y0 + 0.5 - uy;
+  double bx = x1 + 0.5 + ux, by = y1 + 0.5 + uy;
+  double pts[] = {
+    ax - uy, ay + ux,   bx - uy, by + ux,
+    bx + uy, by - ux,   ax + uy, ay - ux,
+  };
+  edge_t edges[4];
+  edge_t *active[4];
+  markPointsDirty(pts, 4);
+  fillEdges(c, edges, active, initEdges(c, edges, pts, 4));
+}
+
+
+static void drawLine(const image_rect_t *c, int x0, int y0, int x1, int y1) {
+  if (graphics_lineWidth > 1) {
+    drawThickLine(c, x0, y0, x1, y1);
+    return;
+  }
+  markDirty(x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+            abs(x1 - x0) + 1, abs(y1 - y0) + 1);
+  #define SWAP_INT(a, b) (((a) ^= (b)), ((b) ^= (a)), ((a) ^= (b)))
+  int steep = abs(y1 - y0) > abs(x1 - x0);
+  if (steep) {
+    SWAP_INT(x0, y0);
+    SWAP_INT(x1, y1);
+  }
+  if (x0 > x1) {
+    SWAP_INT(x0, x1);
+    SWAP_INT(y0, y1);
+  }
+  #undef SWAP_INT
+  int deltax = x1 - x0;
+  int deltay = abs(y1 - y0);
+  int error = deltax / 2;
+  int ystep = (y0 < y1) ? 1 : -1;
+
+  /* The line is stepped along its major axis (x here, y if the line is
+   * steep) from x0 to x1, stepping y on each step which takes the error below
+   * zero. After k steps y has moved m = ceil((k * deltay - error) / deltax)
+   * times, so the range of steps inside the clip rect can be worked out
+   * rather than walked to */
+  int cx0 = steep ? c->y0 : c->x0, cx1 = steep ? c->y1 : c->x1;
+  int cy0 = steep ? c->x0 : c->y0, cy1 = steep ? c->x1 : c->y1;
+  long long k0 = cx0 - x0 > 0 ? cx0 - x0 : 0;
+  long long k1 = cx1 - x0 < deltax ? cx1 - x0 : deltax;
+  long long m0 = ystep > 0 ? cy0 - y0 : y0 - (cy1 - 1);
+  long long m1 = ystep > 0 ? (cy1 - 1) - y0 : y0 - cy0;
+  if (m0 < 0) m0 = 0;
+  if (m1 > deltay) m1 = deltay;
+  if (m0 > m1 || k0 >= k1) return;
+  if (deltay > 0) {
+    long long first = m0 == 0 ? 0 : ((m0 - 1) * deltax + error) / deltay + 1;
+    long long last = (m1 * deltax + error) / deltay + 1;
+    if (first > k0) k0 = first;
+    if (last < k1) k1 = last;
+    if (k0 >= k1) return;
+  }
+  long long n = k0 * deltay - error;
+  long long m = n > 0 ? (n + deltax - 1) / deltax : 0;
+  error += m * deltax - k0 * deltay;
+
+  /* Draw */
+  int stride = graphics_canvas->stride;
+  int x = x0 + k0;
+  int y = y0 + m * ystep;
+  int count = k1 - k0;
+  if (!steep && deltay == 0) {
+    memset(graphics_canvas->data + x + y * stride, graphics_color, count);
+    return;
+  }
+  pixel_t *p = graphics_canvas->data + (steep ? y + x * stride : x + y * stride);
+  int xinc = steep ? stride : 1;
+  if (deltay == 0) {
+    while (count--) {
+      *p = graphics_color;
+      p += xinc;
+    }
+    return;
+  }
+  int yinc = steep ? ystep : ystep * stride;
+  while (count--) {
+    *p = graphics_color;
+    p += xinc;
+    error -= deltay;
+    if (error < 0) {
+      p += yinc;
+      error += deltax;
+    }
+  }
+}
+
+
 int l_graphics_line(lua_State *L) {
   int argc = lua_gettop(L);
   int lastx = luaL_checknumber(L, 1);
   int lasty = luaL_checknumber(L, 2);
   int idx = 3;
+  image_rect_t c;
+  getClip(&c);
   while (idx < argc) {
     int x0 = lastx;
     int y0 = lasty;
@@ -286,35 +1028,7 @@ int l_graphics_line(lua_State *L) {
     int y1 = luaL_checknumber(L, idx + 1);
     lastx = x1;
     lasty = y1;
-    /* Draw line */
-    #define SWAP_INT(a, b) (((a) ^= (b)), ((b) ^= (a)), ((a) ^= (b)))
-    int steep = abs(y1 - y0) > abs(x1 - x0);
-    if (steep) {
-      SWAP_INT(x0, y0);
-      SWAP_INT(x1, y1);
-    }
-    if (x0 > x1) {
-      SWAP_INT(x0, x1);
-      SWAP_INT(y0, y1);
-    }
-    #undef SWAP_INT
-    int deltax = x1 - x0;
-    int deltay = abs(y1 - y0);
-    int error = deltax / 2;
-    int ystep = (y0 < y1) ? 1 : -1;
-    int x, y = y0;
-    for (x = x0; x < x1; x++) {
-      if (steep) {
-        image_setPixel(graphics_canvas, y, x, graphics_color);
-      } else {
-        image_setPixel(graphics_canvas, x, y, graphics_color);
-      }
-      error -= deltay;
-      if (error < 0) {
-        y += ystep;
-        error += deltax;
-      }
-    }
+    drawLine(&c, x0, y0, x1, y1);
     idx += 2;
   }
   return 0;
@@ -335,33 +1049,41 @@ int l_graphics_rectangle(lua_State *L) {
   } else {
     luaL_error(L, "bad mode");
   }
-  /* Clip to screen */
-  if (x < 0) { x2 += x; x = 0; }
-  if (y < 0) { y2 += y; y = 0; }
-  if (x2 > graphics_canvas->width)  { x2 = graphics_canvas->width; }
-  if (y2 > graphics_canvas->height) { y2 = graphics_canvas->height; }
+  /* Clip to canvas and scissor rect, keeping the unclipped edges so the
+   * outline isn't drawn along the clip rect's edges */
+  image_rect_t c;
+  getClip(&c);
+  int left = x, top = y, right = x2, bottom = y2;
+  if (x < c.x0) { x = c.x0; }
+  if (y < c.y0) { y = c.y0; }
+  if (x2 > c.x1) { x2 = c.x1; }
+  if (y2 > c.y1) { y2 = c.y1; }
   /* Get width/height and Abort early if we're off screen */
   int width = x2 - x;
   int height = y2 - y;
   if (width <= 0 || height <= 0) return 0;
+  markDirty(x, y, width, height);
   /* Draw */
+  pixel_t *data = graphics_canvas->data;
+  int bufw = graphics_canvas->stride;
+  int i;
   if (fill) {
-    int i;
     for (i = y; i < y2; i++) {
-      memset(graphics_canvas->data + x + i * graphics_canvas->width,
-             graphics_color, width);
+      memset(data + x + i * bufw, graphics_color, width);
     }
   } else {
-      memset(graphics_canvas->data + x + y * graphics_canvas->width,
-             graphics_color, width);
-      memset(graphics_canvas->data + x + (y2 - 1) * graphics_canvas->width,
-             graphics_color, width);
-      int i;
-      for (i = y; i < y2; i++) {
-        graphics_canvas->data[x + i * graphics_canvas->width] =
-          graphics_canvas->data[x2 - 1 + i * graphics_canvas->width] =
-            graphics_color;
-      }
+    if (top == y) {
+      memset(data + x + y * bufw, graphics_color, width);
+    }
+    if (bottom == y2) {
+      memset(data + x + (y2 - 1) * bufw, graphics_color, width);
+    }
+    if (left == x) {
+      for (i = y; i < y2; i++) data[x + i * bufw] = graphics_color;
+    }
+    if (right == x2) {
+      for (i = y; i < y2; i++) data[x2 - 1 + i * bufw] = graphics_color;
+    }
   }
   return 0;
 }
@@ -380,6 +1102,9 @@ int l_graphics_circle(lua_State *L) {
   } else {
     luaL_error(L, "bad mode");
   }
+  markDirty(x - radius, y - radius, radius * 2 + 1, radius * 2 + 1);
+  image_rect_t c;
+  getClip(&c);
   /* Draw */
   if (fill) {
     int dx = radius, dy = 0;
@@ -390,13 +1115,11 @@ int l_graphics_circle(lua_State *L) {
           int sx = (startx);\
           int ex = (endx);\
           int sy = (starty);\
-          if (sy < 0 || sy >= graphics_canvas->height) break;\
-          if (sx < 0) sx = 0;\
-          if (sx > graphics_canvas->width) sx = graphics_canvas->width;\
-          if (ex < 0) ex = 0;\
-          if (ex > graphics_canvas->width) ex = graphics_canvas->width;\
-          if (sx == ex) break;\
-          memset(graphics_canvas->data + sx + sy * graphics_canvas->width,\
+          if (sy < c.y0 || sy >= c.y1) break;\
+          if (sx < c.x0) sx = c.x0;\
+          if (ex > c.x1) ex = c.x1;\
+          if (sx >= ex) break;\
+          memset(graphics_canvas->data + sx + sy * graphics_canvas->stride,\
                  graphics_color, ex - sx);\
         } while (0)
 
@@ -418,14 +1141,14 @@ int l_graphics_circle(lua_State *L) {
     int dx = radius, dy = 0;
     int radiusError = 1-dx;
     while(dx >= dy) {
-      image_setPixel(graphics_canvas,  dx + x,   dy + y, graphics_color);
-      image_setPixel(graphics_canvas, -dx + x,   dy + y, graphics_color);
-      image_setPixel(graphics_canvas,  dx + x,  -dy + y, graphics_color);
-      image_setPixel(graphics_canvas, -dx + x,  -dy + y, graphics_color);
-      image_setPixel(graphics_canvas,  dy + x,   dx + y, graphics_color);
-      image_setPixel(graphics_canvas, -dy + x,   dx + y, graphics_color);
-      image_setPixel(graphics_canvas,  dy + x,  -dx + y, graphics_color);
-      image_setPixel(graphics_canvas, -dy + x,  -dx + y, graphics_color);
+      clipPixel(&c,  dx + x,   dy + y);
+      clipPixel(&c, -dx + x,   dy + y);
+      clipPixel(&c,  dx + x,  -dy + y);
+      clipPixel(&c, -dx + x,  -dy + y);
+      clipPixel(&c,  dy + x,   dx + y);
+      clipPixel(&c, -dy + x,   dx + y);
+      clipPixel(&c,  dy + x,  -dx + y);
+      clipPixel(&c, -dy + x,  -dx + y);
       dy++;
       if(radiusError<0) {
         radiusError+=2*dy+1;
@@ -439,13 +1162,93 @@ int l_graphics_circle(lua_State *L) {
 }
 
 
+int l_graphics_polygon(lua_State *L) {
+  const char *mode = luaL_checkstring(L, 1);
+  int fill = 0;
+  if (!strcmp(mode, "fill")) {
+    fill = 1;
+  } else if (!strcmp(mode, "line")) {
+    fill = 0;
+  } else {
+    luaL_error(L, "bad mode");
+  }
+  int i, n;
+  double *pts = checkPoints(L, 2, &n);
+  if (n < 3) luaL_error(L, "need at least three vertices to draw a polygon");
+  image_rect_t c;
+  getClip(&c);
+  if (fill) {
+    markPointsDirty(pts, n);
+    edge_t *edges = lua_newuserdata(L, n * (sizeof(edge_t) + sizeof(edge_t*)));
+    edge_t **active = (edge_t**) (edges + n);
+    int count = initEdges(&c, edges, pts, n);
+    fillEdges(&c, edges, active, count);
+  } else {
+    for (i = 0; i < n; i++) {
+      int j = (i + 1) % n;
+      drawLine(&c, pts[i * 2], pts[i * 2 + 1], pts[j * 2], pts[j * 2 + 1]);
+    }
+  }
+  return 0;
+}
+
+
+int l_graphics_triangles(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int i, n;
+  double *pts = checkPoints(L, 1, &n);
+  if (n % 3 != 0) {
+    luaL_error(L, "number of vertices must be a multiple of three");
+  }
+  image_rect_t c;
+  getClip(&c);
+  if (n > 0) markPointsDirty(pts, n);
+  for (i = 0; i < n; i += 3) {
+    edge_t edges[3];
+    edge_t *active[3];
+    int count = initEdges(&c, edges, pts + i * 2, 3);
+    fillEdges(&c, edges, active, count);
+  }
+  return 0;
+}
+
+
 int l_graphics_print(lua_State *L) {
   luaL_checkany(L, 1);
   const char *str = luaL_tolstring(L, 1, NULL);
   int x = luaL_checknumber(L, 2);
   int y = luaL_checknumber(L, 3);
-  font_blit(graphics_font, graphics_canvas->data, graphics_canvas->width,
+  font_blit(graphics_font, graphics_canvas->data, graphics_canvas->stride,
             graphics_canvas->height, str, x, y);
+  if (dirty_isEnabled()) {
+    int bx, by, bw, bh;
+    font_getBounds(graphics_font, str, &bx, &by, &bw, &bh);
+    markDirty(x + bx, y + by, bw, bh);
+  }
+  return 0;
+}
+
+
+int l_graphics_printf(lua_State *L) {
+  luaL_checkany(L, 1);
+  const char *str = luaL_tolstring(L, 1, NULL);
+  int x = luaL_checknumber(L, 2);
+  int y = luaL_checknumber(L, 3);
+  int limit = luaL_checknumber(L, 4);
+  const char *align = luaL_optstring(L, 5, "left");
+  int mode = FONT_ALIGN_LEFT;
+  if      (!strcmp(align, "left"))    mode = FONT_ALIGN_LEFT;
+  else if (!strcmp(align, "center"))  mode = FONT_ALIGN_CENTER;
+  else if (!strcmp(align, "right"))   mode = FONT_ALIGN_RIGHT;
+  else if (!strcmp(align, "justify")) mode = FONT_ALIGN_JUSTIFY;
+  else luaL_argerror(L, 5, "bad align mode");
+  int lines = font_printf(graphics_font, graphics_canvas->data,
+                          graphics_canvas->stride, graphics_canvas->height,
+                          str, x, y, limit, mode);
+  /* Glyphs can overhang the lines' bounds a little, so the dirty rect is
+   * padded by the font's height */
+  int pad = graphics_font->height;
+  markDirty(x - pad, y, limit + pad * 2, (lines + 1) * pad);
   return 0;
 }
 
@@ -455,6 +1258,11 @@ int l_image_new(lua_State *L);
 int l_image_newCanvas(lua_State *L);
 int l_quad_new(lua_State *L);
 int l_font_new(lua_State *L);
+int l_font_newImage(lua_State *L);
+int l_spritebatch_new(lua_State *L);
+int l_tilemap_new(lua_State *L);
+int l_remap_new(lua_State *L);
+int l_text_new(lua_State *L);
 
 int luaopen_graphics(lua_State *L) {
   luaL_Reg reg[] = {
@@ -467,23 +1275,58 @@ int luaopen_graphics(lua_State *L) {
     { "setColor",           l_graphics_setColor           },
     { "getBlendMode",       l_graphics_getBlendMode       },
     { "setBlendMode",       l_graphics_setBlendMode       },
+    { "getLineWidth",       l_graphics_getLineWidth       },
+    { "setLineWidth",       l_graphics_setLineWidth       },
     { "getFont",            l_graphics_getFont            },
     { "setFont",            l_graphics_setFont            },
     { "getCanvas",          l_graphics_getCanvas          },
     { "setCanvas",          l_graphics_setCanvas          },
+    { "getScissor",         l_graphics_getScissor         },
+    { "setScissor",         l_graphics_setScissor         },
+    { "intersectScissor",   l_graphics_intersectScissor   },
+    { "push",               l_graphics_push               },
+    { "pop",                l_graphics_pop                },
     { "reset",              l_graphics_reset              },
     { "clear",              l_graphics_clear              },
     { "present",            l_graphics_present            },
+    { "setVSync",           l_graphics_setVSync           },
+    { "getVSync",           l_graphics_getVSync           },
+    { "setDirtyTracking",   l_graphics_setDirtyTracking   },
+    { "isDirtyTracking",    l_graphics_isDirtyTracking    },
+    { "setAtlasing",        l_graphics_setAtlasing        },
+    { "isAtlasing",         l_graphics_isAtlasing         },
+    { "setCompactImages",   l_graphics_setCompactImages   },
+    { "isCompactImages",    l_graphics_isCompactImages    },
+    { "setImageCaching",    l_graphics_setImageCaching    },
+    { "isImageCaching",     l_graphics_isImageCaching     },
+    { "setQuantizing",      l_graphics_setQuantizing      },
+    { "isQuantizing",       l_graphics_isQuantizing       },
+    { "quantize",           l_graphics_quantize           },
+    { "setNearestColors",   l_graphics_setNearestColors   },
+    { "isNearestColors",    l_graphics_isNearestColors    },
+    { "getPaletteIndex",    l_graphics_getPaletteIndex    },
+    { "getPaletteColor",    l_graphics_getPaletteColor    },
+    { "setPaletteColor",    l_graphics_setPaletteColor    },
+    { "rotatePalette",      l_graphics_rotatePalette      },
+    { "fadePalette",        l_graphics_fadePalette        },
     { "draw",               l_graphics_draw               },
     { "point",              l_graphics_point              },
     { "line",               l_graphics_line               },
     { "rectangle",          l_graphics_rectangle          },
     { "circle",             l_graphics_circle             },
+    { "polygon",            l_graphics_polygon            },
+    { "triangles",          l_graphics_triangles          },
     { "print",              l_graphics_print              },
+    { "printf",             l_graphics_printf             },
     { "newImage",           l_image_new                   },
     { "newCanvas",          l_image_newCanvas             },
     { "newQuad",            l_quad_new                    },
     { "newFont",            l_font_new                    },
+    { "newImageFont",       l_font_newImage               },
+    { "newSpriteBatch",     l_spritebatch_new             },
+    { "newTileMap",         l_tilemap_new                 },
+    { "newRemap",           l_remap_new                   },
+    { "newText",            l_text_new                    },
     { 0, 0 },
   };
   luaL_newlib(L, reg);
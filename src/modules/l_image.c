@@ -5,15 +5,21 @@
  * under the terms of the MIT license. See LICENSE for details.
  */
 
+#include <string.h>
+
 #include "luaobj.h"
 #include "palette.h"
 #include "image.h"
+#include "dirty.h"
 
 
 #define CLASS_TYPE  LUAOBJ_TYPE_IMAGE
 #define CLASS_NAME  "Image"
 
 
+extern image_t *graphics_screen;
+
+
 int l_image_new(lua_State *L) {
   const char *filename = luaL_checkstring(L, 1);
   image_t *self = luaobj_newudata(L, sizeof(*self));
@@ -40,8 +46,37 @@ int l_image_newCanvas(lua_State *L) {
 }
 
 
+int l_image_newView(lua_State *L) {
+  image_t *parent = luaobj_checkudata(L, 1, CLASS_TYPE);
+  int x = luaL_checknumber(L, 2);
+  int y = luaL_checknumber(L, 3);
+  int w = luaL_checknumber(L, 4);
+  int h = luaL_checknumber(L, 5);
+  /* Clip rect to parent */
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > parent->width) w = parent->width - x;
+  if (y + h > parent->height) h = parent->height - y;
+  if (w <= 0 || h <= 0) luaL_error(L, "view rect is outside of the image");
+  image_t *self = luaobj_newudata(L, sizeof(*self));
+  luaobj_setclass(L, CLASS_TYPE, CLASS_NAME);
+  image_initView(self, parent, x, y, w, h);
+  /* Keep the parent alive for as long as the view exists */
+  lua_pushlightuserdata(L, &self->parent);
+  lua_pushvalue(L, 1);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
 int l_image_gc(lua_State *L) {
   image_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  if (self->parent) {
+    /* Release the reference to the parent */
+    lua_pushlightuserdata(L, &self->parent);
+    lua_pushnil(L);
+    lua_settable(L, LUA_REGISTRYINDEX);
+  }
   image_deinit(self);
   return 0;
 }
@@ -79,7 +114,7 @@ int l_image_getPixel(lua_State *L) {
     return 1;
   } else {
     /* Return `nil` if color is transparent, else return 3 channel values */
-    int idx = self->data[x + y * self->width];
+    int idx = self->data[x + y * self->stride];
     if (idx == 0) {
       lua_pushnil(L);
       return 1;
@@ -99,6 +134,10 @@ int l_image_setPixel(lua_State *L) {
   image_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
   int x = luaL_checknumber(L, 2);
   int y = luaL_checknumber(L, 3);
+  image_discardSpans(self);
+  if (self == graphics_screen && dirty_isEnabled()) {
+    dirty_add(x, y, 1, 1);
+  }
   if (lua_isnoneornil(L, 4)) {
     /* Set transparent */
     image_setPixel(self, x, y, 0);
@@ -108,8 +147,8 @@ int l_image_setPixel(lua_State *L) {
     int r = luaL_checknumber(L, 4);
     int g = luaL_checknumber(L, 5);
     int b = luaL_checknumber(L, 6);
-    int idx = palette_colorToIdx(r, g, b);
-    if (idx < -1) {
+    int idx = palette_matchIdx(r, g, b);
+    if (idx < 0) {
       luaL_error(L, "color palette exhausted: use fewer unique colors");
     }
     image_setPixel(self, x, y, idx);
@@ -119,15 +158,184 @@ int l_image_setPixel(lua_State *L) {
 }
 
 
+static void markChanged(image_t *self, int x, int y, int w, int h) {
+  image_discardSpans(self);
+  if (self == graphics_screen && dirty_isEnabled()) {
+    dirty_add(x, y, w, h);
+  }
+}
+
+
+static int checkRect(lua_State *L, image_t *self, int idx,
+                     int *x, int *y, int *w, int *h
+) {
+  /* Gets the optional rect at the stack index, defaulting to the whole image,
+   * clips it to the image and returns 0 if nothing is left */
+  *x = luaL_optnumber(L, idx, 0);
+  *y = luaL_optnumber(L, idx + 1, 0);
+  *w = luaL_optnumber(L, idx + 2, self->width - *x);
+  *h = luaL_optnumber(L, idx + 3, self->height - *y);
+  if (*x < 0) { *w += *x; *x = 0; }
+  if (*y < 0) { *h += *y; *y = 0; }
+  if (*x + *w > self->width) *w = self->width - *x;
+  if (*y + *h > self->height) *h = self->height - *y;
+  return *w > 0 && *h > 0;
+}
+
+
+int l_image_mapPixel(lua_State *L) {
+  image_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  int x0, y0, w, h, x, y;
+  if (!checkRect(L, self, 3, &x0, &y0, &w, &h)) return 0;
+  markChanged(self, x0, y0, w, h);
+  for (y = y0; y < y0 + h; y++) {
+    for (x = x0; x < x0 + w; x++) {
+      /* Call the function with the pixel's position and color, the color is
+       * omitted if the pixel is transparent */
+      int i = x + y * self->stride;
+      int idx = self->data[i];
+      int rgb[3];
+      lua_pushvalue(L, 2);
+      lua_pushinteger(L, x);
+      lua_pushinteger(L, y);
+      if ((self->mask && self->mask[i]) || idx == 0) {
+        lua_call(L, 2, 3);
+      } else {
+        palette_idxToColor(idx, rgb);
+        lua_pushinteger(L, rgb[0]);
+        lua_pushinteger(L, rgb[1]);
+        lua_pushinteger(L, rgb[2]);
+        lua_call(L, 5, 3);
+      }
+      /* Set the pixel to the returned color, or transparent if none is */
+      if (lua_isnil(L, -3)) {
+        idx = 0;
+      } else {
+        idx = palette_matchIdx(luaL_checknumber(L, -3),
+                               luaL_checknumber(L, -2),
+                               luaL_checknumber(L, -1));
+        if (idx < 0) {
+          luaL_error(L, "color palette exhausted: use fewer unique colors");
+        }
+      }
+      self->data[i] = idx;
+      if (self->mask) self->mask[i] = idx ? 0x0 : 0xff;
+      lua_pop(L, 3);
+    }
+  }
+  return 0;
+}
+
+
+int l_image_getString(lua_State *L) {
+  image_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  /* Push the palette indices of the image's pixels row by row as a string;
+   * transparent pixels are 0 */
+  int n = self->width * self->height;
+  int x, y;
+  luaL_Buffer b;
+  char *p = luaL_buffinitsize(L, &b, n);
+  for (y = 0; y < self->height; y++) {
+    pixel_t *data = self->data + y * self->stride;
+    if (self->mask) {
+      pixel_t *mask = self->mask + y * self->stride;
+      for (x = 0; x < self->width; x++) {
+        *p++ = mask[x] ? 0 : data[x];
+      }
+    } else {
+      memcpy(p, data, self->width);
+      p += self->width;
+    }
+  }
+  luaL_pushresultsize(&b, n);
+  return 1;
+}
+
+
+int l_image_replacePixels(lua_State *L) {
+  image_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  size_t len;
+  const char *str = luaL_checklstring(L, 2, &len);
+  if (len != (size_t) (self->width * self->height)) {
+    luaL_argerror(L, 2, "string length does not match the image's size");
+  }
+  /* Set the pixels from a string of palette indices such as one returned by
+   * Image:getString(), indices of 0 are transparent */
+  const pixel_t *p = (const pixel_t*) str;
+  int x, y;
+  markChanged(self, 0, 0, self->width, self->height);
+  for (y = 0; y < self->height; y++) {
+    memcpy(self->data + y * self->stride, p, self->width);
+    if (self->mask) {
+      pixel_t *mask = self->mask + y * self->stride;
+      for (x = 0; x < self->width; x++) {
+        mask[x] = p[x] ? 0x0 : 0xff;
+      }
+    }
+    p += self->width;
+  }
+  return 0;
+}
+
+
+int l_image_paste(lua_State *L) {
+  image_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  image_t *src = luaobj_checkudata(L, 2, CLASS_TYPE);
+  int dx = luaL_checknumber(L, 3);
+  int dy = luaL_checknumber(L, 4);
+  int sx, sy, w, h, diff;
+  if (!checkRect(L, src, 5, &sx, &sy, &w, &h)) return 0;
+  /* Clip to the destination image */
+  if ((diff = -dx) > 0) { w -= diff; sx += diff; dx = 0; }
+  if ((diff = -dy) > 0) { h -= diff; sy += diff; dy = 0; }
+  if ((diff = dx + w - self->width) > 0) w -= diff;
+  if ((diff = dy + h - self->height) > 0) h -= diff;
+  if (w <= 0 || h <= 0) return 0;
+  markChanged(self, dx, dy, w, h);
+
+  /* Copy the pixels and their transparency a row at a time; the images may be
+   * views sharing the same pixels so rows are copied bottom up if the
+   * destination comes after the source */
+  int i, x, y = 0, step = 1;
+  if (self->data + dx + dy * self->stride > src->data + sx + sy * src->stride) {
+    y = h - 1;
+    step = -1;
+  }
+  for (i = 0; i < h; i++, y += step) {
+    int si = sx + (sy + y) * src->stride;
+    int di = dx + (dy + y) * self->stride;
+    memmove(self->data + di, src->data + si, w);
+    if (self->mask && src->mask) {
+      memmove(self->mask + di, src->mask + si, w);
+    } else if (self->mask) {
+      for (x = 0; x < w; x++) {
+        self->mask[di + x] = self->data[di + x] ? 0x0 : 0xff;
+      }
+    } else if (src->mask) {
+      for (x = 0; x < w; x++) {
+        if (src->mask[si + x]) self->data[di + x] = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+
 int luaopen_image(lua_State *L) {
   luaL_Reg reg[] = {
     { "new",            l_image_new           },
     { "__gc",           l_image_gc            },
+    { "newView",        l_image_newView       },
     { "getDimensions",  l_image_getDimensions },
     { "getWidth",       l_image_getWidth      },
     { "getHeight",      l_image_getHeight     },
     { "getPixel",       l_image_getPixel      },
     { "setPixel",       l_image_setPixel      },
+    { "mapPixel",       l_image_mapPixel      },
+    { "getString",      l_image_getString     },
+    { "replacePixels",  l_image_replacePixels },
+    { "paste",          l_image_paste         },
     { 0, 0 },
   };
   luaobj_newclass(L, CLASS_NAME, NULL, l_image_new, reg);
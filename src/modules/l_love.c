@@ -20,6 +20,10 @@ int luaopen_image(lua_State *L);
 int luaopen_quad(lua_State *L);
 int luaopen_font(lua_State *L);
 int luaopen_source(lua_State *L);
+int luaopen_spritebatch(lua_State *L);
+int luaopen_tilemap(lua_State *L);
+int luaopen_remap(lua_State *L);
+int luaopen_text(lua_State *L);
 int luaopen_system(lua_State *L);
 int luaopen_event(lua_State *L);
 int luaopen_filesystem(lua_State *L);
@@ -39,6 +43,10 @@ int luaopen_love(lua_State *L) {
     luaopen_quad,
     luaopen_font,
     luaopen_source,
+    luaopen_spritebatch,
+    luaopen_tilemap,
+    luaopen_remap,
+    luaopen_text,
     NULL,
   };
   for (i = 0; classes[i]; i++) {
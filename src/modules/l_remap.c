@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include "remap.h"
+#include "palette.h"
+#include "luaobj.h"
+
+
+#define CLASS_TYPE  LUAOBJ_TYPE_REMAP
+#define CLASS_NAME  "Remap"
+
+
+static int checkColor(lua_State *L, int idx) {
+  int r = luaL_checknumber(L, idx);
+  int g = luaL_checknumber(L, idx + 1);
+  int b = luaL_checknumber(L, idx + 2);
+  int res = palette_colorToIdx(r, g, b);
+  if (res < 0) {
+    luaL_error(L, "color palette exhausted: use fewer unique colors");
+  }
+  return res;
+}
+
+
+static int findColor(lua_State *L, int idx) {
+  /* Returns the color's palette index without adding it to the palette, or
+   * -1 if it isn't in it; no pixel can have such a color so it needn't be
+   * remapped */
+  int r = luaL_checknumber(L, idx);
+  int g = luaL_checknumber(L, idx + 1);
+  int b = luaL_checknumber(L, idx + 2);
+  return palette_findIdx(r, g, b);
+}
+
+
+static void reset(remap_t *self) {
+  int i;
+  for (i = 0; i < 256; i++) {
+    self->map[i] = i;
+  }
+}
+
+
+int l_remap_new(lua_State *L) {
+  int hasColors = !lua_isnoneornil(L, 1);
+  if (hasColors) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+  }
+  remap_t *self = luaobj_newudata(L, sizeof(*self));
+  luaobj_setclass(L, CLASS_TYPE, CLASS_NAME);
+  reset(self);
+  /* Set the colors from the table of `{ r, g, b, r2, g2, b2 }` entries */
+  if (hasColors) {
+    int i, n;
+    n = lua_rawlen(L, 1);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 1, i);
+      if (!lua_istable(L, -1)) {
+        luaL_error(L, "expected table at index %d", i);
+      }
+      int j;
+      for (j = 1; j <= 6; j++) {
+        lua_rawgeti(L, -j, j);
+      }
+      int from = findColor(L, -6);
+      if (from >= 0) {
+        self->map[from] = checkColor(L, -3);
+      }
+      lua_pop(L, 7);
+    }
+  }
+  return 1;
+}
+
+
+int l_remap_setColor(lua_State *L) {
+  remap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  int from = findColor(L, 2);
+  if (from >= 0) {
+    self->map[from] = checkColor(L, 5);
+  }
+  return 0;
+}
+
+
+int l_remap_getColor(lua_State *L) {
+  remap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  int rgb[3];
+  int from = findColor(L, 2);
+  if (from < 0) {
+    /* Colors not in the palette are left as they are */
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_pushvalue(L, 4);
+    return 3;
+  }
+  if (palette_idxToColor(self->map[from], rgb)) {
+    return 0;
+  }
+  lua_pushinteger(L, rgb[0]);
+  lua_pushinteger(L, rgb[1]);
+  lua_pushinteger(L, rgb[2]);
+  return 3;
+}
+
+
+int l_remap_reset(lua_State *L) {
+  remap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  reset(self);
+  return 0;
+}
+
+
+int luaopen_remap(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "new",          l_remap_new         },
+    { "setColor",     l_remap_setColor    },
+    { "getColor",     l_remap_getColor    },
+    { "reset",        l_remap_reset       },
+    { 0, 0 },
+  };
+  luaobj_newclass(L, CLASS_NAME, NULL, l_remap_new, reg);
+  return 1;
+}
@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include "spritebatch.h"
+#include "quad.h"
+#include "luaobj.h"
+
+
+#define CLASS_TYPE  LUAOBJ_TYPE_SPRITEBATCH
+#define CLASS_NAME  "SpriteBatch"
+
+
+static void checkSprite(lua_State *L, spritebatch_t *self, int idx,
+                        spritebatch_sprite_t *s
+) {
+  /* Fills the sprite from the arguments `[quad,] x, y [, flip]` starting at
+   * the stack index `idx` */
+  if (!lua_isnone(L, idx) && lua_type(L, idx) != LUA_TNUMBER) {
+    quad_t *quad = luaobj_checkudata(L, idx, LUAOBJ_TYPE_QUAD);
+    s->qx = quad->x;
+    s->qy = quad->y;
+    s->qw = quad->width;
+    s->qh = quad->height;
+    idx++;
+  } else {
+    s->qx = 0;
+    s->qy = 0;
+    s->qw = self->image->width;
+    s->qh = self->image->height;
+  }
+  s->x = luaL_optnumber(L, idx, 0);
+  s->y = luaL_optnumber(L, idx + 1, 0);
+  s->flip = !lua_isnone(L, idx + 2) && lua_toboolean(L, idx + 2);
+}
+
+
+int l_spritebatch_new(lua_State *L) {
+  image_t *image = luaobj_checkudata(L, 1, LUAOBJ_TYPE_IMAGE);
+  int capacity = luaL_optnumber(L, 2, 1000);
+  spritebatch_t *self = luaobj_newudata(L, sizeof(*self));
+  luaobj_setclass(L, CLASS_TYPE, CLASS_NAME);
+  spritebatch_init(self, image, capacity);
+  /* Add the image to the registry so it isn't collected while the batch
+   * exists */
+  lua_pushlightuserdata(L, self);
+  lua_pushvalue(L, 1);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+int l_spritebatch_gc(lua_State *L) {
+  spritebatch_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  spritebatch_deinit(self);
+  /* Remove image from registry */
+  lua_pushlightuserdata(L, self);
+  lua_pushnil(L);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+
+int l_spritebatch_add(lua_State *L) {
+  spritebatch_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  spritebatch_sprite_t s;
+  checkSprite(L, self, 2, &s);
+  *spritebatch_push(self) = s;
+  lua_pushinteger(L, self->count);
+  return 1;
+}
+
+
+int l_spritebatch_set(lua_State *L) {
+  spritebatch_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  int id = luaL_checknumber(L, 2);
+  if (id < 1 || id > self->count) {
+    luaL_argerror(L, 2, "sprite id out of range");
+  }
+  checkSprite(L, self, 3, &self->sprites[id - 1]);
+  return 0;
+}
+
+
+int l_spritebatch_clear(lua_State *L) {
+  spritebatch_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  self->count = 0;
+  return 0;
+}
+
+
+int l_spritebatch_getCount(lua_State *L) {
+  spritebatch_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushinteger(L, self->count);
+  return 1;
+}
+
+
+int l_spritebatch_getImage(lua_State *L) {
+  spritebatch_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushlightuserdata(L, self);
+  lua_gettable(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+int luaopen_spritebatch(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "new",            l_spritebatch_new       },
+    { "__gc",           l_spritebatch_gc        },
+    { "add",            l_spritebatch_add       },
+    { "set",            l_spritebatch_set       },
+    { "clear",          l_spritebatch_clear     },
+    { "getCount",       l_spritebatch_getCount  },
+    { "getImage",       l_spritebatch_getImage  },
+    { 0, 0 },
+  };
+  luaobj_newclass(L, CLASS_NAME, NULL, l_spritebatch_new, reg);
+  return 1;
+}
@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include "text.h"
+#include "luaobj.h"
+
+
+#define CLASS_TYPE  LUAOBJ_TYPE_TEXT
+#define CLASS_NAME  "Text"
+
+
+int l_text_new(lua_State *L) {
+  font_t *font = luaobj_checkudata(L, 1, LUAOBJ_TYPE_FONT);
+  const char *str = lua_isnoneornil(L, 2) ? NULL : luaL_tolstring(L, 2, NULL);
+  text_t *self = luaobj_newudata(L, sizeof(*self));
+  luaobj_setclass(L, CLASS_TYPE, CLASS_NAME);
+  text_init(self, font);
+  if (str) text_set(self, str);
+  /* Add the font to the registry so it isn't collected while the text
+   * exists */
+  lua_pushlightuserdata(L, self);
+  lua_pushvalue(L, 1);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+int l_text_gc(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  text_deinit(self);
+  /* Remove font from registry */
+  lua_pushlightuserdata(L, self);
+  lua_pushnil(L);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+
+int l_text_set(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  if (lua_isnoneornil(L, 2)) {
+    text_clear(self);
+  } else {
+    text_set(self, luaL_tolstring(L, 2, NULL));
+  }
+  return 0;
+}
+
+
+int l_text_add(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  const char *str = luaL_tolstring(L, 2, NULL);
+  int x = luaL_optnumber(L, 3, 0);
+  int y = luaL_optnumber(L, 4, 0);
+  lua_pushinteger(L, text_add(self, str, x, y));
+  return 1;
+}
+
+
+int l_text_clear(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  text_clear(self);
+  return 0;
+}
+
+
+int l_text_getDimensions(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushinteger(L, self->x1 - self->x0);
+  lua_pushinteger(L, self->y1 - self->y0);
+  return 2;
+}
+
+
+int l_text_getWidth(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushinteger(L, self->x1 - self->x0);
+  return 1;
+}
+
+
+int l_text_getHeight(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushinteger(L, self->y1 - self->y0);
+  return 1;
+}
+
+
+int l_text_getFont(lua_State *L) {
+  text_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushlightuserdata(L, self);
+  lua_gettable(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+int luaopen_text(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "new",            l_text_new            },
+    { "__gc",           l_text_gc             },
+    { "set",            l_text_set            },
+    { "add",            l_text_add            },
+    { "clear",          l_text_clear          },
+    { "getDimensions",  l_text_getDimensions  },
+    { "getWidth",       l_text_getWidth       },
+    { "getHeight",      l_text_getHeight      },
+    { "getFont",        l_text_getFont        },
+    { 0, 0 },
+  };
+  luaobj_newclass(L, CLASS_NAME, NULL, l_text_new, reg);
+  return 1;
+}
@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include "tilemap.h"
+#include "luaobj.h"
+
+
+#define CLASS_TYPE  LUAOBJ_TYPE_TILEMAP
+#define CLASS_NAME  "TileMap"
+
+
+int l_tilemap_new(lua_State *L) {
+  image_t *image = luaobj_checkudata(L, 1, LUAOBJ_TYPE_IMAGE);
+  int tileWidth = luaL_checknumber(L, 2);
+  int tileHeight = luaL_checknumber(L, 3);
+  int width, height;
+  if (tileWidth <= 0) luaL_argerror(L, 2, "tile width must be larger than 0");
+  if (tileHeight <= 0) luaL_argerror(L, 3, "tile height must be larger than 0");
+  /* Get dimensions from the grid table or the width and height arguments */
+  int hasGrid = lua_istable(L, 4);
+  if (hasGrid) {
+    height = lua_rawlen(L, 4);
+    lua_rawgeti(L, 4, 1);
+    width = lua_istable(L, -1) ? lua_rawlen(L, -1) : 0;
+    lua_pop(L, 1);
+  } else {
+    width = luaL_checknumber(L, 4);
+    height = luaL_checknumber(L, 5);
+  }
+  if (width <= 0 || height <= 0) {
+    luaL_argerror(L, 4, "map width and height must be larger than 0");
+  }
+  /* Init object */
+  tilemap_t *self = luaobj_newudata(L, sizeof(*self));
+  luaobj_setclass(L, CLASS_TYPE, CLASS_NAME);
+  tilemap_init(self, image, tileWidth, tileHeight, width, height);
+  /* Add the image to the registry so it isn't collected while the map
+   * exists */
+  lua_pushlightuserdata(L, self);
+  lua_pushvalue(L, 1);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  /* Fill tiles from grid */
+  if (hasGrid) {
+    int x, y;
+    for (y = 0; y < height; y++) {
+      lua_rawgeti(L, 4, y + 1);
+      if (lua_istable(L, -1)) {
+        for (x = 0; x < width; x++) {
+          lua_rawgeti(L, -1, x + 1);
+          tilemap_setTile(self, x, y, lua_tointeger(L, -1));
+          lua_pop(L, 1);
+        }
+      }
+      lua_pop(L, 1);
+    }
+  }
+  return 1;
+}
+
+
+int l_tilemap_gc(lua_State *L) {
+  tilemap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  tilemap_deinit(self);
+  /* Remove image from registry */
+  lua_pushlightuserdata(L, self);
+  lua_pushnil(L);
+  lua_settable(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+
+int l_tilemap_setTile(lua_State *L) {
+  tilemap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  int x = luaL_checknumber(L, 2);
+  int y = luaL_checknumber(L, 3);
+  int tile = luaL_optnumber(L, 4, 0);
+  tilemap_setTile(self, x, y, tile);
+  return 0;
+}
+
+
+int l_tilemap_getTile(lua_State *L) {
+  tilemap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  int x = luaL_checknumber(L, 2);
+  int y = luaL_checknumber(L, 3);
+  lua_pushinteger(L, tilemap_getTile(self, x, y));
+  return 1;
+}
+
+
+int l_tilemap_getDimensions(lua_State *L) {
+  tilemap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushinteger(L, self->width);
+  lua_pushinteger(L, self->height);
+  return 2;
+}
+
+
+int l_tilemap_setChunkCaching(lua_State *L) {
+  tilemap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  tilemap_setChunkCaching(self, lua_toboolean(L, 2));
+  return 0;
+}
+
+
+int l_tilemap_getImage(lua_State *L) {
+  tilemap_t *self = luaobj_checkudata(L, 1, CLASS_TYPE);
+  lua_pushlightuserdata(L, self);
+  lua_gettable(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+int luaopen_tilemap(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "new",              l_tilemap_new             },
+    { "__gc",             l_tilemap_gc              },
+    { "setTile",          l_tilemap_setTile         },
+    { "getTile",          l_tilemap_getTile         },
+    { "getDimensions",    l_tilemap_getDimensions   },
+    { "setChunkCaching",  l_tilemap_setChunkCaching },
+    { "getImage",         l_tilemap_getImage        },
+    { 0, 0 },
+  };
+  luaobj_newclass(L, CLASS_NAME, NULL, l_tilemap_new, reg);
+  return 1;
+}
@@ -10,6 +10,7 @@
 #include "luaobj.h"
 #include "image.h"
 #include "vga.h"
+#include "frame.h"
 
 long long timer_lastStep;
 double timer_lastDt;
@@ -75,6 +76,55 @@ int l_timer_getTime(lua_State *L) {
 }
 
 
+int l_timer_setTargetFPS(lua_State *L) {
+  frame_setTargetFPS(luaL_optnumber(L, 1, 0));
+  return 0;
+}
+
+
+int l_timer_getTargetFPS(lua_State *L) {
+  lua_pushnumber(L, frame_getTargetFPS());
+  return 1;
+}
+
+
+int l_timer_setFrameSkip(lua_State *L) {
+  frame_setMaxSkip(luaL_optnumber(L, 1, 0));
+  return 0;
+}
+
+
+int l_timer_getFrameSkip(lua_State *L) {
+  lua_pushinteger(L, frame_getMaxSkip());
+  return 1;
+}
+
+
+int l_timer_shouldDraw(lua_State *L) {
+  lua_pushboolean(L, frame_shouldDraw());
+  return 1;
+}
+
+
+int l_timer_getFrameStats(lua_State *L) {
+  frame_stats_t s;
+  frame_getStats(&s);
+  lua_newtable(L);
+  lua_pushinteger(L, s.drawn);
+  lua_setfield(L, -2, "drawn");
+  lua_pushinteger(L, s.skipped);
+  lua_setfield(L, -2, "skipped");
+  lua_pushnumber(L, s.waitTime);
+  lua_setfield(L, -2, "waitTime");
+  lua_pushnumber(L, s.lastWait);
+  lua_setfield(L, -2, "lastWait");
+  if (lua_toboolean(L, 1)) {
+    frame_resetStats();
+  }
+  return 1;
+}
+
+
 int luaopen_timer(lua_State *L) {
   luaL_Reg reg[] = {
     { "step",             l_timer_step              },
@@ -83,6 +133,12 @@ int luaopen_timer(lua_State *L) {
     { "getAverageDelta",  l_timer_getAverageDelta   },
     { "getFPS",           l_timer_getFPS            },
     { "getTime",          l_timer_getTime           },
+    { "setTargetFPS",     l_timer_setTargetFPS      },
+    { "getTargetFPS",     l_timer_getTargetFPS      },
+    { "setFrameSkip",     l_timer_setFrameSkip      },
+    { "getFrameSkip",     l_timer_getFrameSkip      },
+    { "shouldDraw",       l_timer_shouldDraw        },
+    { "getFrameStats",    l_timer_getFrameStats     },
     { 0, 0 },
   };
   luaL_newlib(L, reg);
@@ -6,8 +6,10 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <pc.h>
 
+#include "lib/dmt/dmt.h"
 #include "palette.h"
 #include "vga.h"
 
@@ -19,6 +21,19 @@ struct { unsigned color; int idx; } palette_map[MAP_SIZE];
 unsigned palette_palette[MAX_IDX];
 int palette_nextIdx;
 int palette_inited;
+int palette_version;
+int palette_nearestMode;
+
+/* Changes to the system palette are queued and uploaded by palette_present();
+ * the fade color is blended into the uploaded colors without changing the
+ * palette itself */
+int palette_dirtyFirst = MAX_IDX, palette_dirtyLast = -1;
+int palette_fadeColor[3];
+int palette_fadeAmount;
+
+/* Nearest palette index for each 15bit color, 0xffff if not yet found */
+unsigned short *palette_nearest;
+int palette_nearestVersion = -1;
 
 
 void palette_init(void) {
@@ -31,6 +46,7 @@ void palette_init(void) {
 void palette_reset(void) {
   /* Reset nextIdx -- start at idx 1 as 0 is used for transparency */
   palette_nextIdx = 1;
+  palette_version++;
   /* Reset palette_map */
   int i;
   for (i = 0; i < MAP_SIZE; i++) {
@@ -39,6 +55,12 @@ void palette_reset(void) {
 }
 
 
+static void markDirty(int first, int last) {
+  if (first < palette_dirtyFirst) palette_dirtyFirst = first;
+  if (last > palette_dirtyLast) palette_dirtyLast = last;
+}
+
+
 static unsigned hash(const void *data, int size) {
   unsigned hash = 5381;
   const unsigned char *p = data;
@@ -49,22 +71,50 @@ static unsigned hash(const void *data, int size) {
 }
 
 
+static int findSlot(unsigned color) {
+  /* Returns the hashmap slot holding the color, or the empty slot it would be
+   * added to if it isn't in the hashmap */
+  unsigned h = hash(&color, sizeof(color));
+  int i = h & MAP_MASK;
+  while (palette_map[i].idx != -1) {
+    if (palette_map[i].color == color) {
+      break;
+    }
+    i = (i + 1) & MAP_MASK;
+  }
+  return i;
+}
+
+
+static void rebuildMap(void) {
+  /* Rebuilds the hashmap after palette colors have been changed in place; if
+   * a color is in the palette more than once the lowest index is used. This
+   * doesn't change palette_version, so tables derived from the palette are
+   * left as they are */
+  int i;
+  for (i = 0; i < MAP_SIZE; i++) {
+    palette_map[i].idx = -1;
+  }
+  for (i = 1; i < palette_nextIdx; i++) {
+    int slot = findSlot(palette_palette[i]);
+    if (palette_map[slot].idx == -1) {
+      palette_map[slot].color = palette_palette[i];
+      palette_map[slot].idx = i;
+    }
+  }
+}
+
+
 int palette_colorToIdx(int r, int g, int b) {
   palette_init();
 
   /* Make 24bit rgb color */
   unsigned color = ((b  & 0xff) << 16) | ((g & 0xff) << 8) | (r & 0xff);
 
-  /* Hash color */
-  unsigned h = hash(&color, sizeof(color));
-
   /* Find color in hashmap */
-  int i = h & MAP_MASK;
-  while (palette_map[i].idx != -1) {
-    if (palette_map[i].color == color) {
-      return palette_map[i].idx;
-    }
-    i = (i + 1) & MAP_MASK;
+  int i = findSlot(color);
+  if (palette_map[i].idx != -1) {
+    return palette_map[i].idx;
   }
 
   /* Color wasn't found in hashmap -- Add to system palette and map */
@@ -76,8 +126,9 @@ int palette_colorToIdx(int r, int g, int b) {
   /* Update internal palette table */
   palette_palette[idx] = color;
 
-  /* Update system palette */
-  vga_setPalette(idx, r, g, b);
+  /* Queue system palette update */
+  markDirty(idx, idx);
+  palette_version++;
 
   /* Add to hashmap and return idx */
   palette_map[i].color = color;
@@ -86,6 +137,11 @@ int palette_colorToIdx(int r, int g, int b) {
 }
 
 
+int palette_isUsed(int idx) {
+  return idx > 0 && idx < palette_nextIdx;
+}
+
+
 int palette_idxToColor(int idx, int *rgb) {
   /* Bounds check, return -1 on error */
   if (idx <= 0 || idx >= MAX_IDX) {
@@ -101,3 +157,196 @@ int palette_idxToColor(int idx, int *rgb) {
   /* Return 0 for ok */
   return 0;
 }
+
+
+static int getKey(int r, int g, int b) {
+  return ((r & 0xf8) << 7) | ((g & 0xf8) << 2) | ((b & 0xf8) >> 3);
+}
+
+
+static int getDistance(unsigned color, int key) {
+  /* Returns the weighted distance of the color from the center of the 15bit
+   * color's range */
+  int dr = (int) ((color      ) & 0xff) - (((key >> 7) & 0xf8) | 4);
+  int dg = (int) ((color >>  8) & 0xff) - (((key >> 2) & 0xf8) | 4);
+  int db = (int) ((color >> 16) & 0xff) - (((key << 3) & 0xf8) | 4);
+  return dr * dr * 3 + dg * dg * 4 + db * db * 2;
+}
+
+
+static int nearestOpaque(int key) {
+  /* Returns the closest color to the center of the 15bit color's range,
+   * excluding index 0, or 0 if there are no other colors. Results are cached
+   * in the lookup table, which is reset if the palette has changed since it
+   * was filled */
+  if (!palette_nearest) {
+    palette_nearest = dmt_malloc(32768 * sizeof(*palette_nearest));
+  }
+  if (palette_nearestVersion != palette_version) {
+    int i;
+    for (i = 0; i < 32768; i++) {
+      palette_nearest[i] = 0xffff;
+    }
+    palette_nearestVersion = palette_version;
+  }
+  if (palette_nearest[key] != 0xffff) {
+    return palette_nearest[key];
+  }
+  int i, best = 0, bestDist = 0x7fffffff;
+  for (i = 1; i < palette_nextIdx; i++) {
+    int dist = getDistance(palette_palette[i], key);
+    if (dist < bestDist) {
+      best = i;
+      bestDist = dist;
+    }
+  }
+  palette_nearest[key] = best;
+  return best;
+}
+
+
+int palette_findIdx(int r, int g, int b) {
+  /* Returns the color's index if it's in the palette, else -1 */
+  palette_init();
+  unsigned color = ((b  & 0xff) << 16) | ((g & 0xff) << 8) | (r & 0xff);
+  return palette_map[findSlot(color)].idx;
+}
+
+
+int palette_nearestIdx(int r, int g, int b) {
+  /* Returns the exact color's index if it's in the palette, else the closest
+   * color's. Index 0 is included as black as it is the color of a cleared
+   * canvas */
+  palette_init();
+  int idx = palette_findIdx(r, g, b);
+  if (idx != -1) {
+    return idx;
+  }
+  int key = getKey(r, g, b);
+  idx = nearestOpaque(key);
+  if (!idx || getDistance(0, key) <= getDistance(palette_palette[idx], key)) {
+    return 0;
+  }
+  return idx;
+}
+
+
+int palette_approxIdx(int r, int g, int b) {
+  /* Returns the closest color to the 15bit color, excluding index 0, using
+   * only the lookup table; exact colors aren't looked up. Returns 0 if the
+   * palette has no colors */
+  palette_init();
+  return nearestOpaque(getKey(r, g, b));
+}
+
+
+int palette_nearestOpaqueIdx(int r, int g, int b) {
+  /* Returns the exact color's index if it's in the palette, else the closest
+   * color's excluding index 0, which images use for transparency. If the
+   * palette has no colors the color is added */
+  palette_init();
+  int idx = palette_findIdx(r, g, b);
+  if (idx != -1) {
+    return idx;
+  }
+  idx = nearestOpaque(getKey(r, g, b));
+  return idx ? idx : palette_colorToIdx(r, g, b);
+}
+
+
+void palette_setNearestMode(int enable) {
+  palette_nearestMode = !!enable;
+}
+
+
+int palette_getNearestMode(void) {
+  return palette_nearestMode;
+}
+
+
+int palette_matchIdx(int r, int g, int b) {
+  /* Returns the color's palette index, adding the color to the palette if
+   * needed, or if nearest mode is enabled the index of the closest opaque
+   * color already in the palette */
+  if (palette_nearestMode) {
+    return palette_nearestOpaqueIdx(r, g, b);
+  }
+  return palette_colorToIdx(r, g, b);
+}
+
+
+int palette_setColor(int idx, int r, int g, int b) {
+  /* Sets the color of a palette index already in use; returns -1 if the index
+   * isn't in use */
+  palette_init();
+  if (!palette_isUsed(idx)) {
+    return -1;
+  }
+  palette_palette[idx] = ((b & 0xff) << 16) | ((g & 0xff) << 8) | (r & 0xff);
+  markDirty(idx, idx);
+  rebuildMap();
+  palette_version++;
+  return 0;
+}
+
+
+int palette_rotate(int first, int last, int steps) {
+  /* Rotates the colors of the indices [first, last] towards the higher index
+   * by `steps`, wrapping around; returns -1 if the range isn't in use. As
+   * rotation is meant to be done every frame palette_version isn't changed,
+   * so blend and nearest color tables keep using the colors from before */
+  unsigned tmp[MAX_IDX];
+  palette_init();
+  if (first <= 0 || last >= palette_nextIdx || first > last) {
+    return -1;
+  }
+  int i, n = last - first + 1;
+  steps %= n;
+  if (steps < 0) steps += n;
+  if (steps == 0) return 0;
+  for (i = 0; i < n; i++) {
+    tmp[(i + steps) % n] = palette_palette[first + i];
+  }
+  memcpy(palette_palette + first, tmp, n * sizeof(*tmp));
+  markDirty(first, last);
+  rebuildMap();
+  return 0;
+}
+
+
+void palette_setFade(int r, int g, int b, int amount) {
+  /* Sets the color the system palette is blended towards by `amount` out of
+   * 256; an amount of 0 shows the palette's own colors */
+  amount = amount < 0 ? 0 : amount > 256 ? 256 : amount;
+  if (amount == palette_fadeAmount && (amount == 0 ||
+      (r == palette_fadeColor[0] && g == palette_fadeColor[1] &&
+       b == palette_fadeColor[2]))
+  ) {
+    return;
+  }
+  palette_fadeColor[0] = r;
+  palette_fadeColor[1] = g;
+  palette_fadeColor[2] = b;
+  palette_fadeAmount = amount;
+  markDirty(0, MAX_IDX - 1);
+}
+
+
+void palette_present(void) {
+  /* Uploads the queued changes to the system palette */
+  unsigned char rgb[MAX_IDX * 3];
+  int i, j;
+  if (palette_dirtyLast < palette_dirtyFirst) return;
+  int first = palette_dirtyFirst, n = palette_dirtyLast - first + 1;
+  for (i = 0; i < n; i++) {
+    unsigned color = palette_palette[first + i];
+    for (j = 0; j < 3; j++) {
+      int c = (color >> (j * 8)) & 0xff;
+      c += ((palette_fadeColor[j] - c) * palette_fadeAmount) >> 8;
+      rgb[i * 3 + j] = c;
+    }
+  }
+  vga_setPalettes(first, n, rgb);
+  palette_dirtyFirst = MAX_IDX;
+  palette_dirtyLast = -1;
+}
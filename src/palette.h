@@ -11,6 +11,20 @@
 void palette_init(void);
 void palette_reset(void);
 int palette_colorToIdx(int r, int g, int b);
+int palette_findIdx(int r, int g, int b);
 int palette_idxToColor(int idx, int *rgb);
+int palette_isUsed(int idx);
+int palette_nearestIdx(int r, int g, int b);
+int palette_nearestOpaqueIdx(int r, int g, int b);
+int palette_approxIdx(int r, int g, int b);
+void palette_setNearestMode(int enable);
+int palette_getNearestMode(void);
+int palette_matchIdx(int r, int g, int b);
+int palette_setColor(int idx, int r, int g, int b);
+int palette_rotate(int first, int last, int steps);
+void palette_setFade(int r, int g, int b, int amount);
+void palette_present(void);
+
+extern int palette_version;
 
 #endif
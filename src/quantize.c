@@ -0,0 +1,228 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+
+#include "lib/dmt/dmt.h"
+#include "lib/stb/stb_image.h"
+#include "filesystem.h"
+#include "palette.h"
+#include "quantize.h"
+
+/* While quantizing is enabled images are loaded by mapping each pixel's 15bit
+ * color to the nearest palette color through the palette's lookup table,
+ * rather than adding each exact color to the palette.
+ *
+ * The palette colors which best represent a set of images are reserved by
+ * adding the images to a histogram of 15bit colors with quantize_addImage()
+ * then calling quantize_build(), which splits the histogram's colors using
+ * median cut */
+
+#define RED(c)    (((c) >> 10) & 0x1f)
+#define GREEN(c)  (((c) >>  5) & 0x1f)
+#define BLUE(c)   (((c)      ) & 0x1f)
+#define EXPAND(v) (((v) << 3) | ((v) >> 2))
+
+typedef struct { unsigned short color; unsigned count; } entry_t;
+typedef struct { int first, last, channel, range; unsigned count; } box_t;
+
+extern int palette_nextIdx;
+
+int quantize_enabled;
+int quantize_dither;
+unsigned *quantize_histogram;
+int quantize_channel;
+
+
+void quantize_setEnabled(int enable, int dither) {
+  quantize_enabled = !!enable;
+  quantize_dither = !!dither;
+}
+
+
+int quantize_isEnabled(void) {
+  return quantize_enabled;
+}
+
+
+int quantize_isDithering(void) {
+  return quantize_dither;
+}
+
+
+void quantize_mapRow(pixel_t *dst, const unsigned char *src, int width, int y) {
+  /* Maps a row of 32bit pixels to palette indices, using a 4x4 ordered dither
+   * of up to half a 15bit step if dithering is enabled */
+  static const signed char bayer[4][4] = {
+    { -4,  0, -3,  1 },
+    {  2, -2,  3, -1 },
+    { -3,  1, -4,  0 },
+    {  3, -1,  2, -2 },
+  };
+  int x;
+  const signed char *row = bayer[y & 3];
+  for (x = 0; x < width; x++, src += 4) {
+    if (src[3] < 127) {
+      dst[x] = 0;
+      continue;
+    }
+    int r = src[0], g = src[1], b = src[2];
+    if (quantize_dither) {
+      int d = row[x & 3];
+      r += d; g += d; b += d;
+      r = r < 0 ? 0 : r > 255 ? 255 : r;
+      g = g < 0 ? 0 : g > 255 ? 255 : g;
+      b = b < 0 ? 0 : b > 255 ? 255 : b;
+    }
+    int idx = palette_approxIdx(r, g, b);
+    dst[x] = idx ? idx : palette_colorToIdx(r, g, b);
+  }
+}
+
+
+const char *quantize_addImage(const char *filename) {
+  /* Adds the opaque pixels of the image file to the histogram */
+  int size, width, height, n, i;
+  void *filedata = filesystem_read(filename, &size);
+  if (!filedata) {
+    return "could not read file";
+  }
+  unsigned char *data32 = stbi_load_from_memory(filedata, size,
+                                                &width, &height, &n, 4);
+  filesystem_free(filedata);
+  if (!data32) {
+    return "could not load image file";
+  }
+  if (!quantize_histogram) {
+    quantize_histogram = dmt_calloc(32768, sizeof(*quantize_histogram));
+  }
+  unsigned char *p = data32;
+  for (i = 0; i < width * height; i++, p += 4) {
+    if (p[3] < 127) continue;
+    int key = ((p[0] & 0xf8) << 7) | ((p[1] & 0xf8) << 2) | (p[2] >> 3);
+    quantize_histogram[key]++;
+  }
+  free(data32);
+  return NULL;
+}
+
+
+static void shrinkBox(box_t *box, entry_t *entries) {
+  /* Sets the box's pixel count and the channel its colors vary most in */
+  int i, lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 };
+  box->count = 0;
+  for (i = box->first; i < box->last; i++) {
+    int c = entries[i].color;
+    int v[3] = { RED(c), GREEN(c), BLUE(c) }, j;
+    for (j = 0; j < 3; j++) {
+      if (v[j] < lo[j]) lo[j] = v[j];
+      if (v[j] > hi[j]) hi[j] = v[j];
+    }
+    box->count += entries[i].count;
+  }
+  box->channel = 0;
+  box->range = hi[0] - lo[0];
+  for (i = 1; i < 3; i++) {
+    if (hi[i] - lo[i] > box->range) {
+      box->channel = i;
+      box->range = hi[i] - lo[i];
+    }
+  }
+}
+
+
+static int compareEntries(const void *a, const void *b) {
+  int shift = 10 - quantize_channel * 5;
+  int x = (((const entry_t*) a)->color >> shift) & 0x1f;
+  int y = (((const entry_t*) b)->color >> shift) & 0x1f;
+  return x - y;
+}
+
+
+int quantize_build(int colors) {
+  /* Adds up to `colors` palette colors representing the histogram's colors,
+   * limited by the palette's free space, and clears the histogram. Returns
+   * the number of colors added */
+  int i, n = 0, nboxes = 1;
+  palette_init();
+  if (!quantize_histogram) return 0;
+  if (colors > 256 - palette_nextIdx) colors = 256 - palette_nextIdx;
+
+  /* Get the histogram's colors */
+  entry_t *entries = dmt_malloc(32768 * sizeof(*entries));
+  for (i = 0; i < 32768; i++) {
+    if (quantize_histogram[i]) {
+      entries[n].color = i;
+      entries[n].count = quantize_histogram[i];
+      n++;
+    }
+  }
+  dmt_free(quantize_histogram);
+  quantize_histogram = NULL;
+  if (n == 0 || colors <= 0) {
+    dmt_free(entries);
+    return 0;
+  }
+
+  /* Repeatedly split the box with the most pixels and widest range at the
+   * median of its widest channel */
+  box_t *boxes = dmt_malloc(colors * sizeof(*boxes));
+  boxes[0].first = 0;
+  boxes[0].last = n;
+  shrinkBox(&boxes[0], entries);
+  while (nboxes < colors) {
+    box_t *box = NULL;
+    unsigned long long best = 0;
+    for (i = 0; i < nboxes; i++) {
+      unsigned long long score =
+        (unsigned long long) boxes[i].count * boxes[i].range;
+      if (score > best) {
+        box = &boxes[i];
+        best = score;
+      }
+    }
+    if (!box) break;
+    quantize_channel = box->channel;
+    qsort(entries + box->first, box->last - box->first, sizeof(*entries),
+          compareEntries);
+    unsigned half = box->count / 2, sum = 0;
+    int mid = box->first;
+    while (mid < box->last - 1 && sum + entries[mid].count <= half) {
+      sum += entries[mid++].count;
+    }
+    if (mid == box->first) mid++;
+    box_t *next = &boxes[nboxes++];
+    next->first = mid;
+    next->last = box->last;
+    box->last = mid;
+    shrinkBox(box, entries);
+    shrinkBox(next, entries);
+  }
+
+  /* Add each box's average color to the palette */
+  int added = 0;
+  for (i = 0; i < nboxes; i++) {
+    unsigned long long r = 0, g = 0, b = 0;
+    int j;
+    for (j = boxes[i].first; j < boxes[i].last; j++) {
+      int c = entries[j].color;
+      r += (unsigned long long) EXPAND(RED(c)) * entries[j].count;
+      g += (unsigned long long) EXPAND(GREEN(c)) * entries[j].count;
+      b += (unsigned long long) EXPAND(BLUE(c)) * entries[j].count;
+    }
+    unsigned count = boxes[i].count;
+    int idx = palette_colorToIdx((r + count / 2) / count,
+                                 (g + count / 2) / count,
+                                 (b + count / 2) / count);
+    if (idx < 0) break;
+    added++;
+  }
+
+  dmt_free(boxes);
+  dmt_free(entries);
+  return added;
+}
@@ -0,0 +1,20 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include "vga.h"
+
+void quantize_setEnabled(int enable, int dither);
+int quantize_isEnabled(void);
+int quantize_isDithering(void);
+void quantize_mapRow(pixel_t *dst, const unsigned char *src, int width, int y);
+const char *quantize_addImage(const char *filename);
+int quantize_build(int colors);
+
+#endif
@@ -0,0 +1,17 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef REMAP_H
+#define REMAP_H
+
+#include "vga.h"
+
+typedef struct {
+  pixel_t map[256];
+} remap_t;
+
+#endif
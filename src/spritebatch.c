@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include "lib/dmt/dmt.h"
+#include "spritebatch.h"
+
+
+void spritebatch_init(spritebatch_t *self, image_t *image, int capacity) {
+  memset(self, 0, sizeof(*self));
+  self->image = image;
+  self->capacity = capacity > 0 ? capacity : 1;
+  self->sprites = dmt_malloc(self->capacity * sizeof(*self->sprites));
+}
+
+
+void spritebatch_deinit(spritebatch_t *self) {
+  dmt_free(self->sprites);
+}
+
+
+spritebatch_sprite_t *spritebatch_push(spritebatch_t *self) {
+  /* Adds a sprite to the end of the batch, growing the array if it is full.
+   * Returns a pointer to the new uninitialised sprite */
+  if (self->count == self->capacity) {
+    self->capacity <<= 1;
+    self->sprites = dmt_realloc(self->sprites,
+                                self->capacity * sizeof(*self->sprites));
+  }
+  return &self->sprites[self->count++];
+}
+
+
+void spritebatch_draw(spritebatch_t *self, pixel_t *buf, int bufw, int bufh,
+                      int dx, int dy
+) {
+  spritebatch_sprite_t *s = self->sprites;
+  spritebatch_sprite_t *end = s + self->count;
+  for (; s < end; s++) {
+    image_setFlip(s->flip);
+    image_blit(self->image, buf, bufw, bufh,
+               dx + s->x, dy + s->y, s->qx, s->qy, s->qw, s->qh);
+  }
+}
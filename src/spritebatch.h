@@ -0,0 +1,31 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef SPRITEBATCH_H
+#define SPRITEBATCH_H
+
+#include "image.h"
+
+typedef struct {
+  short x, y;
+  short qx, qy, qw, qh;
+  unsigned char flip;
+} spritebatch_sprite_t;
+
+typedef struct {
+  image_t *image;
+  spritebatch_sprite_t *sprites;
+  int count, capacity;
+} spritebatch_t;
+
+void spritebatch_init(spritebatch_t *self, image_t *image, int capacity);
+void spritebatch_deinit(spritebatch_t *self);
+spritebatch_sprite_t *spritebatch_push(spritebatch_t *self);
+void spritebatch_draw(spritebatch_t *self, pixel_t *buf, int bufw, int bufh,
+                      int dx, int dy);
+
+#endif
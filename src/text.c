@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include "lib/dmt/dmt.h"
+#include "text.h"
+
+extern int image_blendMode;
+extern int image_flip;
+extern unsigned int image_color;
+extern const pixel_t *image_remap;
+
+
+void text_init(text_t *self, font_t *font) {
+  memset(self, 0, sizeof(*self));
+  self->font = font;
+}
+
+
+void text_deinit(text_t *self) {
+  text_clear(self);
+  dmt_free(self->entries);
+}
+
+
+static void discardImage(text_t *self) {
+  if (self->image.data) {
+    image_deinit(&self->image);
+    memset(&self->image, 0, sizeof(self->image));
+  }
+}
+
+
+void text_clear(text_t *self) {
+  int i;
+  for (i = 0; i < self->count; i++) {
+    dmt_free(self->entries[i].str);
+  }
+  self->count = 0;
+  self->x0 = self->y0 = self->x1 = self->y1 = 0;
+  discardImage(self);
+}
+
+
+void text_set(text_t *self, const char *str) {
+  /* Replaces the contents with the string at 0, 0. Setting the string the
+   * text already holds keeps the rendered image */
+  if (self->count == 1 && self->entries[0].x == 0 && self->entries[0].y == 0 &&
+      !strcmp(self->entries[0].str, str)
+  ) {
+    return;
+  }
+  text_clear(self);
+  text_add(self, str, 0, 0);
+}
+
+
+static void renderEntry(text_t *self, text_entry_t *e) {
+  /* Blits the entry's glyphs into the image with a pixel value of 1, or their
+   * own colors if the font is colored, with the clip rect and remap cleared so
+   * they don't affect the result */
+  unsigned oldColor = image_color;
+  const pixel_t *oldRemap = image_remap;
+  image_rect_t oldClip;
+  image_getClip(&oldClip);
+  image_setClip(NULL);
+  image_setColor(1);
+  image_remap = NULL;
+  image_t *img = &self->image;
+  font_blit(self->font, img->data, img->stride, img->height, e->str,
+            e->x - self->x0, e->y - self->y0);
+  image_color = oldColor;
+  image_remap = oldRemap;
+  image_setClip(&oldClip);
+}
+
+
+int text_add(text_t *self, const char *str, int x, int y) {
+  /* Adds the string with its top left at x, y; returns the new number of
+   * entries. If the glyphs fit within the rendered image they are rendered
+   * into it, otherwise the image is re-rendered when it's next drawn */
+  if (self->count == self->capacity) {
+    self->capacity = self->capacity ? self->capacity << 1 : 4;
+    self->entries = dmt_realloc(self->entries,
+                                self->capacity * sizeof(*self->entries));
+  }
+  text_entry_t *e = &self->entries[self->count++];
+  int len = strlen(str);
+  e->str = dmt_malloc(len + 1);
+  memcpy(e->str, str, len + 1);
+  e->x = x;
+  e->y = y;
+
+  /* Grow the bounds to include the entry */
+  int bx, by, bw, bh;
+  font_getBounds(self->font, str, &bx, &by, &bw, &bh);
+  if (bw <= 0 || bh <= 0) return self->count;
+  bx += x;
+  by += y;
+  if (self->x0 == self->x1) {
+    self->x0 = bx;
+    self->y0 = by;
+    self->x1 = bx + bw;
+    self->y1 = by + bh;
+  } else if (bx < self->x0 || by < self->y0 ||
+             bx + bw > self->x1 || by + bh > self->y1
+  ) {
+    if (bx < self->x0) self->x0 = bx;
+    if (by < self->y0) self->y0 = by;
+    if (bx + bw > self->x1) self->x1 = bx + bw;
+    if (by + bh > self->y1) self->y1 = by + bh;
+    discardImage(self);
+  } else if (self->image.data) {
+    renderEntry(self, e);
+    image_initSpans(&self->image);
+  }
+  return self->count;
+}
+
+
+static void render(text_t *self) {
+  /* Renders all the entries into a new image whose transparency is derived
+   * from its data */
+  int i;
+  image_t *img = &self->image;
+  image_initBlank(img, self->x1 - self->x0, self->y1 - self->y0);
+  dmt_free(img->mask);
+  img->mask = NULL;
+  for (i = 0; i < self->count; i++) {
+    renderEntry(self, &self->entries[i]);
+  }
+  image_initSpans(img);
+}
+
+
+void text_draw(text_t *self, pixel_t *buf, int bufw, int bufh,
+               int dx, int dy
+) {
+  if (self->x0 == self->x1) return;
+  if (!self->image.data) render(self);
+
+  int oldBlendMode = image_blendMode;
+  int oldFlip = image_flip;
+  image_blendMode = self->font->colored ? IMAGE_NORMAL : IMAGE_COLOR;
+  image_flip = 0;
+  image_blit(&self->image, buf, bufw, bufh, dx + self->x0, dy + self->y0,
+             0, 0, self->image.width, self->image.height);
+  image_blendMode = oldBlendMode;
+  image_flip = oldFlip;
+}
@@ -0,0 +1,40 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef TEXT_H
+#define TEXT_H
+
+#include "image.h"
+#include "font.h"
+
+typedef struct {
+  char *str;
+  int x, y;
+} text_entry_t;
+
+typedef struct {
+  font_t *font;
+  text_entry_t *entries;
+  int count, capacity;
+  int x0, y0, x1, y1;
+  image_t image;
+} text_t;
+
+/* The entries' glyphs cover the rect [x0, x1) x [y0, y1) relative to the
+ * text's position. `image` is the glyphs pre-rendered with a pixel value of 1
+ * and transparency derived from the data; its data is NULL if it needs to be
+ * rendered before it is next drawn */
+
+void text_init(text_t *self, font_t *font);
+void text_deinit(text_t *self);
+void text_clear(text_t *self);
+void text_set(text_t *self, const char *str);
+int text_add(text_t *self, const char *str, int x, int y);
+void text_draw(text_t *self, pixel_t *buf, int bufw, int bufh,
+               int dx, int dy);
+
+#endif
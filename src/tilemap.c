@@ -0,0 +1,255 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include "lib/dmt/dmt.h"
+#include "tilemap.h"
+
+extern int image_blendMode;
+extern int image_flip;
+extern const pixel_t *image_remap;
+
+
+static int getKind(image_t *img, int x0, int y0, int w, int h) {
+  /* Returns whether the rect of the image is fully transparent, fully opaque
+   * or a mixture of both */
+  int x, y, opaque = 0, transparent = 0;
+  for (y = y0; y < y0 + h; y++) {
+    for (x = x0; x < x0 + w; x++) {
+      int i = x + y * img->stride;
+      int t = img->mask ? img->mask[i] : !img->data[i];
+      if (t) transparent = 1; else opaque = 1;
+    }
+  }
+  if (!opaque) return TILEMAP_EMPTY;
+  if (!transparent) return TILEMAP_OPAQUE;
+  return TILEMAP_MASKED;
+}
+
+
+static int getChanges(image_t *img) {
+  /* Returns a count which differs whenever the image's pixels have changed,
+   * including through its parent if it's a view */
+  return img->changes + (img->parent ? img->parent->changes : 0);
+}
+
+
+static void classifyTiles(tilemap_t *self) {
+  /* Classifies each of the tileset's tiles so opaque tiles can be drawn
+   * without transparency and empty ones skipped */
+  int i;
+  image_t *image = self->image;
+  self->tileKinds[0] = TILEMAP_EMPTY;
+  for (i = 0; i < self->tileCount; i++) {
+    int x = (i % self->columns) * self->tileWidth;
+    int y = (i / self->columns) * self->tileHeight;
+    self->tileKinds[i + 1] =
+      getKind(image, x, y, self->tileWidth, self->tileHeight);
+  }
+  self->imageChanges = getChanges(image);
+}
+
+
+void tilemap_init(tilemap_t *self, image_t *image, int tileWidth,
+                  int tileHeight, int width, int height
+) {
+  memset(self, 0, sizeof(*self));
+  self->image = image;
+  self->tileWidth = tileWidth;
+  self->tileHeight = tileHeight;
+  self->width = width;
+  self->height = height;
+  self->tiles = dmt_calloc(width * height, sizeof(*self->tiles));
+
+  self->columns = image->width / tileWidth;
+  self->tileCount = self->columns * (image->height / tileHeight);
+  self->tileKinds = dmt_malloc(self->tileCount + 1);
+  classifyTiles(self);
+}
+
+
+void tilemap_deinit(tilemap_t *self) {
+  tilemap_setChunkCaching(self, 0);
+  dmt_free(self->tiles);
+  dmt_free(self->tileKinds);
+}
+
+
+void tilemap_setTile(tilemap_t *self, int x, int y, int tile) {
+  if (x < 0 || x >= self->width || y < 0 || y >= self->height) return;
+  if (tile < 0 || tile > self->tileCount) tile = 0;
+  self->tiles[x + y * self->width] = tile;
+  /* Discard the cached chunk containing the tile */
+  if (self->chunks) {
+    int cx = x / TILEMAP_CHUNK_SIZE;
+    int cy = y / TILEMAP_CHUNK_SIZE;
+    tilemap_chunk_t *c = &self->chunks[cx + cy * self->chunksWide];
+    image_deinit(&c->image);
+    memset(c, 0, sizeof(*c));
+  }
+}
+
+
+int tilemap_getTile(tilemap_t *self, int x, int y) {
+  if (x < 0 || x >= self->width || y < 0 || y >= self->height) return 0;
+  return self->tiles[x + y * self->width];
+}
+
+
+void tilemap_setChunkCaching(tilemap_t *self, int enable) {
+  /* Enables or disables the caching of pre-rendered chunks of
+   * TILEMAP_CHUNK_SIZE x TILEMAP_CHUNK_SIZE tiles. Chunks are rendered when
+   * first drawn and discarded when one of their tiles changes */
+  int i;
+  if (self->chunks) {
+    for (i = 0; i < self->chunksWide * self->chunksHigh; i++) {
+      image_deinit(&self->chunks[i].image);
+    }
+    dmt_free(self->chunks);
+    self->chunks = NULL;
+  }
+  if (enable) {
+    int n = TILEMAP_CHUNK_SIZE;
+    self->chunksWide = (self->width + n - 1) / n;
+    self->chunksHigh = (self->height + n - 1) / n;
+    self->chunks = dmt_calloc(self->chunksWide * self->chunksHigh,
+                              sizeof(*self->chunks));
+  }
+}
+
+
+static void drawTiles(tilemap_t *self, pixel_t *buf, int bufw, int bufh,
+                      int dx, int dy, int tx0, int ty0, int tx1, int ty1
+) {
+  /* Draws the tiles in the rect [tx0, tx1) x [ty0, ty1) with the map's top
+   * left at dx, dy. Opaque tiles are drawn with IMAGE_FAST if the blend mode
+   * is IMAGE_NORMAL */
+  int tx, ty;
+  int mode = image_blendMode;
+  int tw = self->tileWidth;
+  int th = self->tileHeight;
+  for (ty = ty0; ty < ty1; ty++) {
+    unsigned short *row = self->tiles + ty * self->width;
+    for (tx = tx0; tx < tx1; tx++) {
+      int t = row[tx];
+      int kind = self->tileKinds[t];
+      if (kind == TILEMAP_EMPTY) continue;
+      t--;
+      image_blendMode =
+        (kind == TILEMAP_OPAQUE && mode == IMAGE_NORMAL) ? IMAGE_FAST : mode;
+      image_blit(self->image, buf, bufw, bufh, dx + tx * tw, dy + ty * th,
+                 (t % self->columns) * tw, (t / self->columns) * th, tw, th);
+    }
+  }
+  image_blendMode = mode;
+}
+
+
+static void renderChunk(tilemap_t *self, tilemap_chunk_t *c, int cx, int cy) {
+  /* Pre-renders the chunk's tiles and its mask into the chunk's image */
+  int n = TILEMAP_CHUNK_SIZE;
+  int tx0 = cx * n, ty0 = cy * n;
+  int tx1 = tx0 + n, ty1 = ty0 + n;
+  if (tx1 > self->width) tx1 = self->width;
+  if (ty1 > self->height) ty1 = self->height;
+  int w = (tx1 - tx0) * self->tileWidth;
+  int h = (ty1 - ty0) * self->tileHeight;
+  image_t *img = &c->image;
+  image_initBlank(img, w, h);
+
+  /* Draw the tiles' pixels, then AND their masks into the chunk's mask by
+   * blitting the tileset's mask as if it were pixel data. If the tileset's
+   * mask is derived from its data then so is the chunk's */
+  int oldMode = image_blendMode;
+  int oldFlip = image_flip;
+  const pixel_t *oldRemap = image_remap;
+  image_rect_t oldClip;
+  image_getClip(&oldClip);
+  image_setClip(NULL);
+  image_flip = 0;
+  image_remap = NULL;
+  image_blendMode = IMAGE_NORMAL;
+  drawTiles(self, img->data, w, h, -tx0 * self->tileWidth,
+            -ty0 * self->tileHeight, tx0, ty0, tx1, ty1);
+  image_t *tileset = self->image;
+  if (tileset->mask) {
+    memset(img->mask, 0xff, w * h);
+    image_t maskImage = *tileset;
+    maskImage.data = tileset->mask;
+    maskImage.spans = NULL;
+    self->image = &maskImage;
+    image_blendMode = IMAGE_AND;
+    drawTiles(self, img->mask, w, h, -tx0 * self->tileWidth,
+              -ty0 * self->tileHeight, tx0, ty0, tx1, ty1);
+    self->image = tileset;
+  } else {
+    dmt_free(img->mask);
+    img->mask = NULL;
+  }
+  image_blendMode = oldMode;
+  image_flip = oldFlip;
+  image_remap = oldRemap;
+  image_setClip(&oldClip);
+
+  c->kind = getKind(img, 0, 0, w, h);
+  image_initSpans(img);
+}
+
+
+void tilemap_draw(tilemap_t *self, pixel_t *buf, int bufw, int bufh,
+                  int dx, int dy
+) {
+  int tw = self->tileWidth;
+  int th = self->tileHeight;
+  image_flip = 0;
+
+  /* Reclassify the tiles and discard the cached chunks if the tileset's
+   * pixels have changed since they were classified */
+  if (getChanges(self->image) != self->imageChanges) {
+    classifyTiles(self);
+    if (self->chunks) tilemap_setChunkCaching(self, 1);
+  }
+
+  if (!self->chunks) {
+    /* Get visible tiles and draw them */
+    int tx0 = dx < 0 ? -dx / tw : 0;
+    int ty0 = dy < 0 ? -dy / th : 0;
+    int tx1 = (bufw - dx + tw - 1) / tw;
+    int ty1 = (bufh - dy + th - 1) / th;
+    if (tx1 > self->width) tx1 = self->width;
+    if (ty1 > self->height) ty1 = self->height;
+    drawTiles(self, buf, bufw, bufh, dx, dy, tx0, ty0, tx1, ty1);
+    return;
+  }
+
+  /* Get visible chunks, render any which aren't cached and draw them */
+  int cw = tw * TILEMAP_CHUNK_SIZE;
+  int ch = th * TILEMAP_CHUNK_SIZE;
+  int cx0 = dx < 0 ? -dx / cw : 0;
+  int cy0 = dy < 0 ? -dy / ch : 0;
+  int cx1 = (bufw - dx + cw - 1) / cw;
+  int cy1 = (bufh - dy + ch - 1) / ch;
+  if (cx1 > self->chunksWide) cx1 = self->chunksWide;
+  if (cy1 > self->chunksHigh) cy1 = self->chunksHigh;
+  int cx, cy;
+  int mode = image_blendMode;
+  for (cy = cy0; cy < cy1; cy++) {
+    for (cx = cx0; cx < cx1; cx++) {
+      tilemap_chunk_t *c = &self->chunks[cx + cy * self->chunksWide];
+      if (!c->image.data) {
+        renderChunk(self, c, cx, cy);
+      }
+      if (c->kind == TILEMAP_EMPTY) continue;
+      image_blendMode =
+        (c->kind == TILEMAP_OPAQUE && mode == IMAGE_NORMAL) ? IMAGE_FAST : mode;
+      image_blit(&c->image, buf, bufw, bufh, dx + cx * cw, dy + cy * ch,
+                 0, 0, c->image.width, c->image.height);
+    }
+  }
+  image_blendMode = mode;
+}
@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2017 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef TILEMAP_H
+#define TILEMAP_H
+
+#include "image.h"
+
+#define TILEMAP_CHUNK_SIZE 8
+
+enum {
+  TILEMAP_EMPTY,
+  TILEMAP_OPAQUE,
+  TILEMAP_MASKED,
+};
+
+typedef struct {
+  image_t image;
+  int kind;
+} tilemap_chunk_t;
+
+typedef struct {
+  image_t *image;
+  int tileWidth, tileHeight;
+  int width, height;
+  int columns, tileCount;
+  unsigned short *tiles;
+  unsigned char *tileKinds;
+  int imageChanges;
+  tilemap_chunk_t *chunks;
+  int chunksWide, chunksHigh;
+} tilemap_t;
+
+void tilemap_init(tilemap_t *self, image_t *image, int tileWidth,
+                  int tileHeight, int width, int height);
+void tilemap_deinit(tilemap_t *self);
+void tilemap_setTile(tilemap_t *self, int x, int y, int tile);
+int tilemap_getTile(tilemap_t *self, int x, int y);
+void tilemap_setChunkCaching(tilemap_t *self, int enable);
+void tilemap_draw(tilemap_t *self, pixel_t *buf, int bufw, int bufh,
+                  int dx, int dy);
+
+#endif
@@ -42,6 +42,39 @@ void vga_setPalette(int idx, int r, int g, int b) {
 }
 
 
+void vga_setPalettes(int first, int count, const unsigned char *rgb) {
+  /* Sets `count` palette entries from `first` with a single index write, the
+   * DAC advancing to the next entry after each color */
+  int i;
+  outp(0x03c8, first);
+  for (i = 0; i < count * 3; i++) {
+    outp(0x03c9, (rgb[i] >> 2) & 0x3f);
+  }
+}
+
+
+void vga_waitRetrace(void) {
+  /* Waits for the start of the next vertical retrace */
+  while (inp(0x03da) & 0x08);
+  while (!(inp(0x03da) & 0x08));
+}
+
+
 void vga_update(pixel_t *buffer) {
   dosmemput(buffer, VGA_WIDTH * VGA_HEIGHT, 0xa0000);
 }
+
+
+void vga_updateRect(pixel_t *buffer, int x, int y, int w, int h) {
+  /* Copies a rect of the buffer to video memory; rects spanning whole rows
+   * are copied in a single transfer */
+  int offset = x + y * VGA_WIDTH;
+  if (w == VGA_WIDTH) {
+    dosmemput(buffer + offset, w * h, 0xa0000 + offset);
+    return;
+  }
+  while (h--) {
+    dosmemput(buffer + offset, w, 0xa0000 + offset);
+    offset += VGA_WIDTH;
+  }
+}
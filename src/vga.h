@@ -16,6 +16,9 @@ typedef unsigned char pixel_t;
 void vga_init(void);
 void vga_deinit(void);
 void vga_setPalette(int idx, int r, int g, int b);
+void vga_setPalettes(int first, int count, const unsigned char *rgb);
+void vga_waitRetrace(void);
 void vga_update(pixel_t *buffer);
+void vga_updateRect(pixel_t *buffer, int x, int y, int w, int h);
 
 #endif